@@ -28,6 +28,28 @@
 #include <linux/err.h>
 #include <linux/mutex.h>
 #include <linux/of.h>
+#include <linux/workqueue.h>
+#include <linux/rcupdate.h>
+#include <linux/cache.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/sort.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/capability.h>
+#include <linux/kref.h>
+#include <linux/wait.h>
+#include <linux/list.h>
+#include <linux/completion.h>
+#include <linux/rwsem.h>
+#include <asm/unaligned.h>
+
+#include "occ.h"
+#include "occ_sim.h"
 
 #define DEBUG    1
 #define default_console_loglevel 8
@@ -35,27 +57,56 @@
 
 /* ------------------------------------------------------------*/
 /* OCC sensor data format */
+/* sensor block types: the 4 bytes of sensor_type as a big-endian u32 */
+#define OCC_BLOCK_TEMP		0x54454d50	/* "TEMP" */
+#define OCC_BLOCK_FREQ		0x46524551	/* "FREQ" */
+#define OCC_BLOCK_POWR		0x504f5752	/* "POWR" */
+#define OCC_BLOCK_CAPS		0x43415053	/* "CAPS" */
+
+#define OCC_MAX_SENSORS		(OCC_DATA_MAX / OCC_SENSOR_RECORD_SIZE)
+#define OCC_MAX_POWR_SENSORS	(OCC_DATA_MAX / OCC_POWR_RECORD_SIZE)
+#define OCC_MAX_CAPS_SENSORS	(OCC_DATA_MAX / OCC_CAPS_RECORD_SIZE)
+
+/*
+ * Parsed sensors are kept per type as structure-of-arrays, so reading one
+ * sensor is a single index and exporting all of a type is a linear scan.
+ * Sensors of every block of a type are appended to that type's table.
+ */
 typedef struct {
-	uint16_t sensor_id;
-	uint16_t value;
-} occ_sensor;
+	uint16_t num;
+	uint16_t ids[OCC_MAX_SENSORS] ____cacheline_aligned;
+	uint16_t values[OCC_MAX_SENSORS] ____cacheline_aligned;
+} occ_sensor_table;
 
 typedef struct {
-	uint16_t sensor_id;
-	uint32_t update_tag;
-	uint32_t accumulator;
-	uint16_t value;
-} powr_sensor;
+	uint16_t num;
+	uint16_t ids[OCC_MAX_POWR_SENSORS] ____cacheline_aligned;
+	uint16_t values[OCC_MAX_POWR_SENSORS] ____cacheline_aligned;
+	uint32_t update_tags[OCC_MAX_POWR_SENSORS] ____cacheline_aligned;
+	uint32_t accumulators[OCC_MAX_POWR_SENSORS] ____cacheline_aligned;
+} powr_sensor_table;
+
+/* power caps, in W */
+typedef struct {
+	uint16_t num;
+	uint16_t curr_powercap[OCC_MAX_CAPS_SENSORS] ____cacheline_aligned;
+	uint16_t curr_powerreading[OCC_MAX_CAPS_SENSORS] ____cacheline_aligned;
+	uint16_t norm_powercap[OCC_MAX_CAPS_SENSORS] ____cacheline_aligned;
+	uint16_t max_powercap[OCC_MAX_CAPS_SENSORS] ____cacheline_aligned;
+	uint16_t min_powercap[OCC_MAX_CAPS_SENSORS] ____cacheline_aligned;
+	uint16_t user_powerlimit[OCC_MAX_CAPS_SENSORS] ____cacheline_aligned;
+} caps_sensor_table;
 
 
 typedef struct {
 	char sensor_type[5];
+	uint32_t type;		/* OCC_BLOCK_* */
 	uint8_t reserved0;
 	uint8_t sensor_format;
 	uint8_t sensor_length;
 	uint8_t num_of_sensors;
-	occ_sensor *sensor;
-	powr_sensor *powr;
+	uint16_t first;		/* index of the block's first sensor in its table */
+	uint16_t offset;	/* of the block's records in the response */
 } sensor_data_block;
 
 typedef struct {
@@ -85,86 +136,372 @@ typedef struct {
 	uint16_t data_length;
 	occ_poll_data data;
 	uint16_t chk_sum;
-	uint16_t temp_block_id;	
-	uint16_t freq_block_id;	
-	uint16_t power_block_id;	
+	occ_sensor_table *temp;
+	occ_sensor_table *freq;
+	powr_sensor_table *powr;
+	caps_sensor_table *caps;
+	uint8_t *image;		/* binary snapshot, see occ_snapshot_hdr */
+	int image_len;
+	unsigned long checked;	/* jiffies: POLL that last found it current was sent */
 } occ_response_t;
 
-static occ_response_t occ_resp;
+/*
+ * Binary snapshot served by the 'snapshot' file, built once per poll. A
+ * packed header, then the per-type arrays in host byte order, then the
+ * header's seq again so a reader can tell it did not straddle two polls:
+ *
+ *	u16 temp_ids[num_temp], u16 temp_values[num_temp]
+ *	u16 freq_ids[num_freq], u16 freq_values[num_freq]
+ *	u16 powr_ids[num_powr], u16 powr_values[num_powr]
+ *	u32 powr_update_tags[num_powr], u32 powr_accumulators[num_powr]
+ *	u16 caps_curr_powercap[num_caps], u16 caps_curr_powerreading[num_caps],
+ *	u16 caps_norm_powercap[num_caps], u16 caps_max_powercap[num_caps],
+ *	u16 caps_min_powercap[num_caps], u16 caps_user_powerlimit[num_caps]
+ *	u32 seq
+ *
+ * Version 2 added num_caps and the caps arrays.
+ */
+#define OCC_SNAPSHOT_MAGIC	0x4f434353	/* "OCCS" */
+#define OCC_SNAPSHOT_VERSION	2
+
+struct occ_snapshot_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t hdr_size;
+	uint32_t size;		/* whole image, trailing seq included */
+	uint32_t seq;		/* bumped on every published poll */
+	uint64_t timestamp;	/* ktime_get_ns() when its POLL was sent */
+	uint8_t occ_seq;	/* sequence_num of the response */
+	uint8_t occ_state;
+	uint16_t num_temp;
+	uint16_t num_freq;
+	uint16_t num_powr;
+	uint16_t num_caps;
+} __packed;
+
+/*
+ * No record serializes to more than its size on the wire (4 bytes for
+ * TEMP and FREQ, 12 for POWR and CAPS), and the records of a response fit
+ * in OCC_DATA_MAX. Plus the trailing seq.
+ */
+#define OCC_SNAPSHOT_MAX	(sizeof(struct occ_snapshot_hdr) + OCC_DATA_MAX + 4)
+
+/*
+ * Backing store for one parsed response, sized for the largest response
+ * the OCC can send, and reused across polls, so refreshing never
+ * allocates.
+ */
+struct occ_arena {
+	uint8_t			num_blocks;	/* of blocks[] the tables match, 0: none */
+	bool			values_only;	/* last parse kept the layout */
+	sensor_data_block	blocks[OCC_MAX_BLOCKS];
+	occ_sensor_table	temp;
+	occ_sensor_table	freq;
+	powr_sensor_table	powr;
+	caps_sensor_table	caps;
+	uint8_t			image[OCC_SNAPSHOT_MAX] __aligned(8);
+};
+
+/*
+ * mmap layout of /dev/occ-<client>: one page holding struct occ_ring_hdr,
+ * then num_slots slots of slot_size bytes, each a snapshot image as served
+ * by the 'snapshot' file. Snapshot seq lives in slot seq % num_slots and
+ * head is the seq of the newest one. The poller zeroes a slot's seq before
+ * rewriting it and stores the new seq last, so a reader copies a slot
+ * between two reads of its seq and keeps the copy only if both match the
+ * seq it wanted.
+ */
+#define OCC_RING_MAGIC		0x4f434352	/* "OCCR" */
+#define OCC_RING_VERSION	1
+#define OCC_RING_SLOTS		16
+#define OCC_RING_SLOT_SIZE	ALIGN(OCC_SNAPSHOT_MAX, 8)
+
+struct occ_ring_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t hdr_size;
+	uint32_t slot_size;
+	uint32_t num_slots;
+	uint32_t data_offset;	/* of slot 0, from the start of the mapping */
+	uint32_t head;		/* seq of the newest snapshot, 0 if none */
+} __packed;
+
+/* refcounted: open files and mappings may outlive the device */
+struct occ_ring {
+	struct kref		kref;
+	void			*mem;		/* vmalloc_user() */
+	size_t			size;
+	struct occ_ring_hdr	*hdr;
+	wait_queue_head_t	wait;
+	bool			dead;		/* device removed */
+	struct rw_semaphore	owner_sem;	/* read side held by ioctls */
+	struct occ_drv_data	*owner;		/* NULL once the device is removed */
+};
+
+/*
+ * OCC_IOC_CMD on the same device: hand one command to the poller and wait
+ * for the OCC's answer. POLLs from any number of callers are answered by
+ * the poller's own next POLL, so they cost no extra bus traffic; other
+ * commands are sent one at a time, right after that poll.
+ */
+struct occ_cmd_ioc {
+	uint8_t type;
+	uint8_t reserved;
+	uint16_t data_len;
+	uint8_t data[OCC_CMD_DATA_MAX];
+	uint16_t resp_len;	/* out: whole response, checksum included */
+	uint8_t resp[OCC_DATA_MAX];
+} __packed;
+
+#define OCC_IOC_MAGIC	'o'
+#define OCC_IOC_CMD	_IOWR(OCC_IOC_MAGIC, 1, struct occ_cmd_ioc)
+
+/* an OCC_IOC_CMD waiting on the poller, on occ_drv_data.cmd_queue */
+struct occ_cmd_req {
+	struct list_head	list;
+	bool			taken;		/* by the poller, under cmd_lock */
+	struct completion	done;
+	int			ret;
+	struct occ_cmd_ioc	ioc;
+};
+
+/* per open file */
+struct occ_ring_file {
+	struct occ_ring		*ring;
+	uint32_t		seen;		/* head last returned by read() */
+};
+
+#define OCC_SRAM_BATCH	32	/* 8-byte SRAM reads per i2c_transfer() */
+
+/* bus accounting, written by the poller only */
+#define OCC_LAT_WINDOW	1024	/* polls kept: p99 is then the 11th slowest */
+
+struct occ_stats {
+	unsigned long		polls;
+	unsigned long		poll_errors;
+	unsigned long		polls_unchanged;	/* nothing new from the OCC */
+	unsigned long		polls_unchanged_tag;	/* of those, seen before the bulk read */
+	unsigned long		cmd_timeouts;	/* no response to a command in time */
+	unsigned long		checksum_errors;	/* responses dropped */
+	unsigned int		xfers;		/* bus transactions, this poll */
+	unsigned int		msgs;		/* i2c messages, this poll */
+	unsigned int		bytes;		/* bytes on the wire, this poll */
+	unsigned int		resp_bytes;	/* response size, this poll */
+	unsigned int		last_xfers;	/* same, for the last poll */
+	unsigned int		last_msgs;
+	unsigned int		last_bytes;
+	unsigned int		last_resp_bytes;
+	unsigned long		parses;		/* successful parse_occ_response() */
+	unsigned long		parses_values_only;	/* of those, layout unchanged */
+	u64			parse_ns;	/* last parse */
+	u64			parse_ns_min;
+	u64			parse_ns_max;
+	u64			parse_ns_total;
+	unsigned int		parse_sensors;	/* sensors decoded by the last parse */
+	unsigned long		cmd_reqs;	/* OCC_IOC_CMD requests served */
+	unsigned long		cmd_reqs_coalesced;	/* of those, POLLs that shared a poll */
+	unsigned int		sample_age_us;	/* POLL sent to published, last publish */
+	unsigned int		poll_us[OCC_LAT_WINDOW]; /* start to snapshot, last polls */
+	u64			publish_ns[OCC_LAT_WINDOW];	/* when they were published */
+	unsigned long		poll_us_count;
+};
+
+#define OCC_LABEL_LEN	24
+
+struct occ_freq_attr {
+	struct sensor_device_attribute	input;
+	struct sensor_device_attribute	label;
+	char				input_name[16];
+	char				label_name[16];
+};
 
 /* Each client has this additional data */
 struct occ_drv_data {
 	struct i2c_client	*client;
 	struct device		*hwmon_dev;
 	struct mutex		update_lock;
-	char			valid;		/* !=0 if sensor data are valid */
 	unsigned long		last_updated;	/* In jiffies */
 	unsigned long		sample_time;	/* In jiffies */
-	occ_response_t		*occ_resp;
+	unsigned int		backoff;	/* poll every sample_time * backoff */
+	struct delayed_work	poll_work;	/* refreshes occ_buf[occ_next] */
+	occ_response_t __rcu	*occ_resp;	/* published, NULL until 1st poll */
+	occ_response_t		*occ_buf[2];	/* double buffer behind occ_resp */
+	struct occ_arena	*occ_arena[2];	/* storage for occ_buf[i] */
+	int			occ_next;	/* occ_buf index the poller fills */
+	bool			bulk_read;	/* adapter does repeated start */
+	struct occ_sim		*sim;		/* simulate=1: no bus at all */
+	char			occ_raw[OCC_DATA_MAX];	/* response as read */
+	int			raw_len;	/* of the checked response in occ_raw */
+	char			occ_pub[OCC_DATA_MAX];	/* the published one, as read */
+	int			pub_len;	/* 0 until the first publish */
+	uint8_t			occ_cmd[OCC_CMD_MAX];	/* command as written */
+	uint8_t			cmd_seq;	/* of the last command, never 0 */
+	u64			cmd_sent_ns;	/* cmd_seq's doorbell, ktime_get_ns() */
+	unsigned long		cmd_sent;	/* same, in jiffies */
+	u64			resp_sent_ns;	/* same, for the response in occ_raw */
+	unsigned long		resp_sent;
+	spinlock_t		cmd_lock;	/* cmd_queue and poll_* below */
+	struct list_head	cmd_queue;	/* occ_cmd_req, for the poller */
+	bool			poll_queued;	/* poll_work pending, due at poll_due */
+	unsigned long		poll_due;
+	bool			polling;	/* queued POLLs still join this poll */
+	unsigned long		poll_started;	/* of the last poll, in jiffies */
+	struct i2c_msg		sram_msgs[2 * OCC_SRAM_BATCH];
+	char			sram_rx[8 * OCC_SRAM_BATCH];
+	struct occ_stats	stats;
+	bool			removing;	/* under update_lock and cmd_lock */
+	bool			suspended;	/* under cmd_lock: nothing queues the poller */
+	uint32_t		snap_seq;	/* last published snapshot */
+	struct occ_ring		*ring;
+	struct miscdevice	miscdev;
+
+	/* hwmon channels, generated from the first poll, at probe */
+	struct hwmon_chip_info	chip;
+	const struct hwmon_channel_info *channels[4];
+	struct hwmon_channel_info chip_ch;
+	struct hwmon_channel_info temp_ch;
+	struct hwmon_channel_info power_ch;
+	char			(*temp_labels)[OCC_LABEL_LEN];
+	char			(*power_labels)[OCC_LABEL_LEN];
+	uint16_t		*temp_ids;	/* what the channels were registered for */
+	uint16_t		*power_ids;
+	struct occ_freq_attr	*freq_attrs;
+	struct attribute_group	freq_group;
+	const struct attribute_group *groups[3];
 };
 
+
+static bool revalidate;
+module_param(revalidate, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(revalidate, "Readers that find a poll due start it, without waiting for it");
+
+#define OCC_RESP_UNCHANGED	1	/* occ_get_all(): nothing new to publish */
+#define OCC_MAX_BACKOFF		8	/* unchanged polls stretch the interval up to 8x */
+
+#define OCC_UPDATE_INTERVAL_MIN	10	/* In ms */
+#define OCC_UPDATE_INTERVAL_MAX	60000	/* In ms */
+
 /*-----------------------------------------------------------------------*/
 /* i2c read and write occ sensors */
+/*
+ * All bus traffic goes through occ_i2c_read(), occ_i2c_write() and
+ * occ_i2c_transfer(); nothing else calls into the i2c core.
+ */
 
-#define OCC_DATA_MAX 4096 /* 4KB at most */
-#define I2C_STATUS_REG 0x000d0001
-#define I2C_ERROR_REG  0x000d0002
 #define I2C_READ_ERROR 1
 #define I2C_WRITE_ERROR 2
 #define I2C_DATABUFFER_SIZE_ERROR 3
 
-#define SCOM_OCC_SRAM_WOX  0x0006B013
-#define SCOM_OCC_SRAM_WAND 0x0006B012
-#define SCOM_OCC_SRAM_ADDR 0x0006B010
-#define SCOM_OCC_SRAM_DATA 0x0006B015
-#define OCC_COMMAND_ADDR 0xFFFF6000
-#define OCC_RESPONSE_ADDR 0xFFFF7000
 
 static int deinit_occ_resp_buf(occ_response_t *p)
 {
-	int b;
-
 	if (p == NULL)
 		return 0;
 
-	if (p->data.blocks == NULL)
-		return 0;
+	/* blocks and sensors live in the arena, nothing to free */
+	memset(p, 0, sizeof(*p));
+
+	return 0;
+}
+
+/*
+ * Responses and commands end in the 16-bit sum of all bytes before. Summed
+ * 8 bytes at a time: the even and odd bytes of each word are added into
+ * four 16-bit lanes, which take 128 words before they can overflow.
+ */
+static uint16_t occ_checksum_fold(u64 lanes)
+{
+	lanes = (lanes & 0x0000ffff0000ffffULL) + ((lanes >> 16) & 0x0000ffff0000ffffULL);
+	return lanes + (lanes >> 32);
+}
 
-	for(b = 0; b < p->data.num_of_sensor_blocks; b++) {
-		if (!p->data.blocks[b].sensor)	
-			kfree(p->data.blocks[b].sensor);
-		if (!p->data.blocks[b].powr)	
-			kfree(p->data.blocks[b].powr);
+static uint16_t occ_checksum(const uint8_t *d, int len)
+{
+	const u64 mask = 0x00ff00ff00ff00ffULL;
+	u64 lanes = 0;
+	u64 w;
+	uint16_t sum = 0;
+	int i = 0;
+	int n = 0;
+
+	for (; i + 8 <= len; i += 8) {
+		w = get_unaligned((const u64 *)(d + i));
+		lanes = lanes + (w & mask) + ((w >> 8) & mask);
+		if (++n == 128) {
+			sum = sum + occ_checksum_fold(lanes);
+			lanes = 0;
+			n = 0;
+		}
 	}
+	sum = sum + occ_checksum_fold(lanes);
 
-	kfree(p->data.blocks);
-	
-	memset(p, 0, sizeof(*p));
+	for (; i < len; i++)
+		sum = sum + d[i];
 
-	return 0;
+	return sum;
+}
+
+static void occ_account_xfer(struct i2c_client *client, int msgs, int bytes)
+{
+	struct occ_drv_data *data = i2c_get_clientdata(client);
+
+	data->stats.xfers++;
+	data->stats.msgs += msgs;
+	if (bytes > 0)
+		data->stats.bytes += bytes;
 }
 
 static ssize_t occ_i2c_read(struct i2c_client *client, char *buf, size_t count)
 {
+	struct occ_drv_data *data = i2c_get_clientdata(client);
 	int ret = 0;
 
 	if (count > 8192)
 		count = 8192;
 
 	pr_debug("i2c_read: reading %zu bytes.\n", count);
-	ret = i2c_master_recv(client, buf, count);
+	if (data->sim)
+		ret = occ_sim_read(data->sim, buf, count);
+	else
+		ret = i2c_master_recv(client, buf, count);
+	occ_account_xfer(client, 1, ret);
 	return ret;
 }
 
 static ssize_t occ_i2c_write(struct i2c_client *client, const char *buf, size_t count)
 {
+	struct occ_drv_data *data = i2c_get_clientdata(client);
 	int ret = 0;
 
 	if (count > 8192)
 		count = 8192;
 
 	pr_debug("i2c_write: writing %zu bytes.\n", count);
-	ret = i2c_master_send(client, buf, count);
+	if (data->sim)
+		ret = occ_sim_write(data->sim, buf, count);
+	else
+		ret = i2c_master_send(client, buf, count);
+	occ_account_xfer(client, 1, ret);
+	return ret;
+}
+
+/* returns num on success, like i2c_transfer() */
+static int occ_i2c_transfer(struct i2c_client *client, struct i2c_msg *msgs, int num)
+{
+	struct occ_drv_data *data = i2c_get_clientdata(client);
+	int ret = 0;
+	int bytes = 0;
+	int i;
+
+	for (i = 0; i < num; i++)
+		bytes = bytes + msgs[i].len;
+
+	pr_debug("i2c_transfer: %d messages.\n", num);
+	if (data->sim)
+		ret = occ_sim_transfer(data->sim, msgs, num);
+	else
+		ret = i2c_transfer(client->adapter, msgs, num);
+	occ_account_xfer(client, num, ret == num ? bytes : 0);
 	return ret;
 }
 
@@ -218,6 +555,63 @@ static int occ_getscomb(struct i2c_client *client, uint32_t address, char* data,
 	return 0;
 }
 
+/*
+ * read len bytes (multiple of 8) into data[offset], 8 bytes per SCOM read.
+ * Each read is an address write plus a repeated-start read, and up to
+ * OCC_SRAM_BATCH of them go out in a single i2c_transfer(), instead of
+ * a STOP-separated send/recv pair per 8 bytes.
+ */
+static int occ_getscomb_bulk(struct i2c_client *client, uint32_t address, char* data,
+			     int offset, int len)
+{
+	struct occ_drv_data *drv = i2c_get_clientdata(client);
+	struct i2c_msg *msgs = drv->sram_msgs;
+	char *rx = drv->sram_rx;
+	const char* address_buf = (const char*)&address;
+	int n, i, b;
+	int ret = 0;
+
+	if (!drv->bulk_read) {
+		for (b = 0; b < len; b = b + 8) {
+			ret = occ_getscomb(client, address, data, offset + b);
+			if (ret)
+				return ret;
+		}
+		return 0;
+	}
+
+	//P8 i2c slave requires address to be shifted by 1
+	address = address << 1;
+
+	while (len > 0) {
+		n = min(len / 8, OCC_SRAM_BATCH);
+
+		for (i = 0; i < n; i++) {
+			msgs[2 * i].addr = client->addr;
+			msgs[2 * i].flags = 0;
+			msgs[2 * i].len = sizeof(address);
+			msgs[2 * i].buf = (u8 *)address_buf;
+			msgs[2 * i + 1].addr = client->addr;
+			msgs[2 * i + 1].flags = I2C_M_RD;
+			msgs[2 * i + 1].len = 8;
+			msgs[2 * i + 1].buf = (u8 *)&rx[8 * i];
+		}
+
+		ret = occ_i2c_transfer(client, msgs, 2 * n);
+		if (ret != 2 * n)
+			return -I2C_READ_ERROR;
+
+		for (i = 0; i < n; i++)
+			for (b = 0; b < 8; b++)
+				data[offset + 8 * i + b] = rx[8 * i + 7 - b];
+
+		offset = offset + 8 * n;
+		len = len - 8 * n;
+	}
+
+	return 0;
+}
+
 static int occ_putscom(struct i2c_client *client, uint32_t address, uint32_t data0, uint32_t data1)
 {
 	const char* address_buf = (const char*)&address;
@@ -259,26 +653,254 @@ static int occ_check_i2c_errors(struct i2c_client *client)
 
 static inline uint16_t get_occdata_length(char* d)
 {
-	uint16_t data_length = 0;
-	
-	data_length = d[3] << 8;
-	data_length = data_length | d[4];
-	return data_length;
+	return get_unaligned_be16(&d[3]);
+}
+
+/* whole response on the wire: header, data_length bytes of data, checksum */
+static inline int get_occresp_length(char* d)
+{
+	return OCC_RESP_HDR_SIZE + get_occdata_length(d) + OCC_RESP_CHKSUM_SIZE;
+}
+
+
+/*
+ * Block decoders: append the num_of_sensors records of blk, sensor_length
+ * bytes apart starting at d, to the block type's table. Fields are
+ * big-endian and records need not be aligned. parse_occ_response() has
+ * already checked that the records are in the response and fit the table.
+ */
+static void occ_decode_id_value(uint16_t *ids, uint16_t *values, const uint8_t *d,
+				int n, int stride)
+{
+	uint32_t v;
+	int s;
+
+	/* the usual packed case: one 32-bit load per (id, value) record */
+	if (stride == OCC_SENSOR_RECORD_SIZE) {
+		for (s = 0; s < n; s++) {
+			v = get_unaligned_be32(d + s * OCC_SENSOR_RECORD_SIZE);
+			ids[s] = v >> 16;
+			values[s] = v;
+		}
+		return;
+	}
+
+	for (s = 0; s < n; s++, d += stride) {
+		ids[s] = get_unaligned_be16(d);
+		values[s] = get_unaligned_be16(d + 2);
+	}
+}
+
+static void occ_decode_sensors(occ_sensor_table *t, sensor_data_block *blk,
+			       const uint8_t *d)
+{
+	blk->first = t->num;
+	occ_decode_id_value(&t->ids[t->num], &t->values[t->num], d,
+			    blk->num_of_sensors, blk->sensor_length);
+	t->num = t->num + blk->num_of_sensors;
+}
+
+static void occ_decode_temp(occ_response_t *o, sensor_data_block *blk, const uint8_t *d)
+{
+	occ_decode_sensors(o->temp, blk, d);
+}
+
+static void occ_decode_freq(occ_response_t *o, sensor_data_block *blk, const uint8_t *d)
+{
+	occ_decode_sensors(o->freq, blk, d);
+}
+
+static void occ_decode_powr(occ_response_t *o, sensor_data_block *blk, const uint8_t *d)
+{
+	powr_sensor_table *p = o->powr;
+	int s, i;
+
+	blk->first = p->num;
+	for (s = 0, i = p->num; s < blk->num_of_sensors; s++, i++, d += blk->sensor_length) {
+		p->ids[i] = get_unaligned_be16(d);
+		p->update_tags[i] = get_unaligned_be32(d + 2);
+		p->accumulators[i] = get_unaligned_be32(d + 6);
+		p->values[i] = get_unaligned_be16(d + 10);
+	}
+	p->num = i;
+}
+
+static void occ_decode_caps(occ_response_t *o, sensor_data_block *blk, const uint8_t *d)
+{
+	caps_sensor_table *c = o->caps;
+	int s, i;
+
+	blk->first = c->num;
+	for (s = 0, i = c->num; s < blk->num_of_sensors; s++, i++, d += blk->sensor_length) {
+		c->curr_powercap[i] = get_unaligned_be16(d);
+		c->curr_powerreading[i] = get_unaligned_be16(d + 2);
+		c->norm_powercap[i] = get_unaligned_be16(d + 4);
+		c->max_powercap[i] = get_unaligned_be16(d + 6);
+		c->min_powercap[i] = get_unaligned_be16(d + 8);
+		c->user_powerlimit[i] = get_unaligned_be16(d + 10);
+	}
+	c->num = i;
+}
+
+/*
+ * Value-only counterparts of the decoders, for a block whose head is the
+ * same as when its table was last filled: ids and positions are already
+ * there. They return false if a sensor id moved after all.
+ */
+static bool occ_update_sensors(occ_sensor_table *t, sensor_data_block *blk,
+			       const uint8_t *d)
+{
+	uint16_t *ids = &t->ids[blk->first];
+	uint16_t *values = &t->values[blk->first];
+	uint16_t diff = 0;
+	uint32_t v;
+	int s;
+
+	if (blk->sensor_length == OCC_SENSOR_RECORD_SIZE) {
+		for (s = 0; s < blk->num_of_sensors; s++) {
+			v = get_unaligned_be32(d + s * OCC_SENSOR_RECORD_SIZE);
+			diff |= ids[s] ^ (v >> 16);
+			values[s] = v;
+		}
+	} else {
+		for (s = 0; s < blk->num_of_sensors; s++, d += blk->sensor_length) {
+			diff |= ids[s] ^ get_unaligned_be16(d);
+			values[s] = get_unaligned_be16(d + 2);
+		}
+	}
+
+	return diff == 0;
+}
+
+static bool occ_update_temp(occ_response_t *o, sensor_data_block *blk, const uint8_t *d)
+{
+	return occ_update_sensors(o->temp, blk, d);
+}
+
+static bool occ_update_freq(occ_response_t *o, sensor_data_block *blk, const uint8_t *d)
+{
+	return occ_update_sensors(o->freq, blk, d);
+}
+
+static bool occ_update_powr(occ_response_t *o, sensor_data_block *blk, const uint8_t *d)
+{
+	powr_sensor_table *p = o->powr;
+	uint16_t diff = 0;
+	int s, i;
+
+	for (s = 0, i = blk->first; s < blk->num_of_sensors; s++, i++, d += blk->sensor_length) {
+		diff |= p->ids[i] ^ get_unaligned_be16(d);
+		p->update_tags[i] = get_unaligned_be32(d + 2);
+		p->accumulators[i] = get_unaligned_be32(d + 6);
+		p->values[i] = get_unaligned_be16(d + 10);
+	}
+
+	return diff == 0;
+}
+
+/* no ids: a full decode in place */
+static bool occ_update_caps(occ_response_t *o, sensor_data_block *blk, const uint8_t *d)
+{
+	caps_sensor_table *c = o->caps;
+	uint16_t num = c->num;
+
+	c->num = blk->first;
+	occ_decode_caps(o, blk, d);
+	c->num = num;
+
+	return true;
+}
+
+/* a new block type is one entry here plus its table */
+static const struct occ_block_handler {
+	uint32_t type;
+	uint8_t record_size;	/* smallest sensor_length it can decode */
+	uint16_t max;		/* capacity of its table */
+	void (*decode)(occ_response_t *o, sensor_data_block *blk, const uint8_t *d);
+	bool (*update)(occ_response_t *o, sensor_data_block *blk, const uint8_t *d);
+} occ_block_handlers[] = {
+	{ OCC_BLOCK_TEMP, OCC_SENSOR_RECORD_SIZE, OCC_MAX_SENSORS,
+	  occ_decode_temp, occ_update_temp },
+	{ OCC_BLOCK_FREQ, OCC_SENSOR_RECORD_SIZE, OCC_MAX_SENSORS,
+	  occ_decode_freq, occ_update_freq },
+	{ OCC_BLOCK_POWR, OCC_POWR_RECORD_SIZE, OCC_MAX_POWR_SENSORS,
+	  occ_decode_powr, occ_update_powr },
+	{ OCC_BLOCK_CAPS, OCC_CAPS_RECORD_SIZE, OCC_MAX_CAPS_SENSORS,
+	  occ_decode_caps, occ_update_caps },
+};
+
+/* does blk, from an earlier parse, still describe the 8-byte head hdr */
+static bool occ_block_same(const sensor_data_block *blk, const uint8_t *hdr)
+{
+	return blk->type == get_unaligned_be32(hdr) &&
+	       blk->sensor_format == hdr[5] &&
+	       blk->sensor_length == hdr[6] &&
+	       blk->num_of_sensors == hdr[7];
+}
+
+/* bounds-checked reader over the sensor data of one response */
+struct occ_cursor {
+	const uint8_t *p;
+	const uint8_t *end;
+};
+
+/*
+ * the next n bytes, or NULL if fewer than n are left. Needs end >= p,
+ * which parse_occ_response() checks before it sets the cursor up.
+ */
+static const uint8_t *occ_cursor_take(struct occ_cursor *c, unsigned int n)
+{
+	const uint8_t *p = c->p;
+
+	if (n > (size_t)(c->end - c->p))
+		return NULL;
+	c->p = c->p + n;
+
+	return p;
 }
 
+static const struct occ_block_handler *occ_block_handler(uint32_t type)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(occ_block_handlers); i++)
+		if (occ_block_handlers[i].type == type)
+			return &occ_block_handlers[i];
+
+	return NULL;
+}
 
-static int parse_occ_response(char* d, occ_response_t* o)
+/*
+ * d holds len bytes, the full response as sized by its header. All block
+ * heads are read and every block's records checked to lie inside the
+ * response and to fit their table before anything is decoded, so a
+ * corrupt header costs one walk over at most 255 heads and is rejected.
+ *
+ * a's tables still hold what it parsed two polls ago. If every block head
+ * is unchanged since then only the values are refreshed in place.
+ */
+static int parse_occ_response(uint8_t *d, int len, occ_response_t* o, struct occ_arena *a)
 {
 	int b = 0;
-	int s = 0;
-	int ret = 0;
-	int dnum = 45;
+	int i;
+	uint16_t need[ARRAY_SIZE(occ_block_handlers)] = { 0 };
+	struct occ_cursor c;
+	bool same;
+	const uint8_t *hdr;
+	const uint8_t *rec;
+	sensor_data_block *blk;
+	const struct occ_block_handler *h;
+
+	if (len < OCC_POLL_HDR_SIZE) {
+		printk("ERROR: OCC response too short (%d bytes)\n", len);
+		return -1;
+	}
 	
 	o->sequence_num = d[0];
 	o->cmd_type = d[1];
 	o->rtn_status = d[2];
-	o->data_length = d[3] << 8;
-	o->data_length = o->data_length | d[4];
+	o->data_length = get_unaligned_be16(&d[3]);
+	o->chk_sum = get_unaligned_be16(&d[len - OCC_RESP_CHKSUM_SIZE]);
 	o->data.status = d[5];
 	o->data.ext_status = d[6];
 	o->data.occs_present = d[7];
@@ -287,12 +909,8 @@ static int parse_occ_response(char* d, occ_response_t* o)
 	o->data.reserved0 = d[10];
 	o->data.reserved1 = d[11];
 	o->data.error_log_id = d[12];
-	o->data.error_log_addr_start = d[13] << 24;
-	o->data.error_log_addr_start = o->data.error_log_addr_start | d[14] << 16;
-	o->data.error_log_addr_start = o->data.error_log_addr_start | d[15] << 8;
-	o->data.error_log_addr_start = o->data.error_log_addr_start | d[16];
-	o->data.error_log_length = d[17] << 8;
-	o->data.error_log_length = o->data.error_log_length | d[18];
+	o->data.error_log_addr_start = get_unaligned_be32(&d[13]);
+	o->data.error_log_length = get_unaligned_be16(&d[17]);
 	o->data.reserved2 = d[19];
 	o->data.reserved3 = d[20];
 	strncpy(&o->data.occ_code_level[0], (const char*)&d[21], 16);
@@ -301,6 +919,19 @@ static int parse_occ_response(char* d, occ_response_t* o)
 	o->data.num_of_sensor_blocks=d[43];
 	o->data.sensor_data_version = d[44];
 	
+	if (OCC_RESP_HDR_SIZE + o->data_length + OCC_RESP_CHKSUM_SIZE > len) {
+		printk("ERROR: OCC data_length %u exceeds the %d bytes read\n",
+		       o->data_length, len);
+		return -EBADMSG;
+	}
+
+	/* the poll data up to the block count is part of data_length too */
+	if (o->data_length < OCC_POLL_HDR_SIZE - OCC_RESP_HDR_SIZE) {
+		printk("ERROR: OCC data_length %u too short for the poll data\n",
+		       o->data_length);
+		return -EBADMSG;
+	}
+
 	if (strcmp(o->data.sensor_eye_catcher, "SENSOR") != 0) {
 		printk("ERROR: SENSOR not found at byte 37 (%s)\n",o->data.sensor_eye_catcher);
 		return -1;
@@ -311,394 +942,1486 @@ static int parse_occ_response(char* d, occ_response_t* o)
 		return -1;
 	}
 
-	o->data.blocks = kzalloc(sizeof(sensor_data_block) * o->data.num_of_sensor_blocks, GFP_KERNEL);
-	if (o->data.blocks == NULL)
-		return -ENOMEM;
+	/* the sensor data: from the poll header to the end of data_length */
+	c.p = d + OCC_POLL_HDR_SIZE;
+	c.end = d + OCC_RESP_HDR_SIZE + o->data_length;
+
+	/* blocks[] gets overwritten below, the tables only match it again on success */
+	same = a->num_blocks == o->data.num_of_sensor_blocks;
+	a->num_blocks = 0;
   	
-	printk("Reading %d sensor blocks\n", o->data.num_of_sensor_blocks);
+	pr_debug("Reading %d sensor blocks\n", o->data.num_of_sensor_blocks);
 	for(b = 0; b < o->data.num_of_sensor_blocks; b++) {
+		blk = &a->blocks[b];
+
 		/* 8-byte sensor block head */
-		strncpy(&o->data.blocks[b].sensor_type[0], (const char*)&d[dnum], 4);
-		o->data.blocks[b].reserved0 = d[dnum+4];
-		o->data.blocks[b].sensor_format = d[dnum+5];
-		o->data.blocks[b].sensor_length = d[dnum+6];
-		o->data.blocks[b].num_of_sensors = d[dnum+7];
-		dnum = dnum + 8;
+		hdr = occ_cursor_take(&c, 8);
+		if (!hdr) {
+			printk("ERROR: sensor block %d head past the response\n", b);
+			return -EBADMSG;
+		}
+		same = same && occ_block_same(blk, hdr);
+		memcpy(blk->sensor_type, hdr, 4);
+		blk->sensor_type[4] = '\0';
+		blk->type = get_unaligned_be32(hdr);
+		blk->reserved0 = hdr[4];
+		blk->sensor_format = hdr[5];
+		blk->sensor_length = hdr[6];
+		blk->num_of_sensors = hdr[7];
+
+		rec = occ_cursor_take(&c, blk->num_of_sensors * blk->sensor_length);
+		if (!rec) {
+			printk("ERROR: sensor block %d (%s) records past the response\n",
+			       b, blk->sensor_type);
+			return -EBADMSG;
+		}
+		blk->offset = rec - d;
 		
-		printk("sensor block[%d]: type: %s, num_of_sensors: %d, sensor_length: %u\n",
-			b, o->data.blocks[b].sensor_type, o->data.blocks[b].num_of_sensors,
-			o->data.blocks[b].sensor_length);
+		pr_debug("sensor block[%d]: type: %s, num_of_sensors: %d, sensor_length: %u\n",
+			b, blk->sensor_type, blk->num_of_sensors, blk->sensor_length);
 	
 		/* empty sensor block */	
-		if (o->data.blocks[b].num_of_sensors <= 0)
+		if (blk->num_of_sensors == 0 || blk->sensor_length == 0)
 			continue;
-		if (o->data.blocks[b].sensor_length == 0)
+
+		h = occ_block_handler(blk->type);
+		if (!h) {
+			/* not ours: stepped over */
+			pr_debug("sensor type %s not supported, skipped\n", blk->sensor_type);
 			continue;
-		
-		if (strcmp(o->data.blocks[b].sensor_type, "FREQ") == 0) {	
-			o->data.blocks[b].sensor = 
-				kzalloc(sizeof(occ_sensor) * o->data.blocks[b].num_of_sensors, GFP_KERNEL);
-			
-			if (o->data.blocks[b].sensor == NULL) {
-				ret = -ENOMEM;
-				goto abort;
-			}
-			o->freq_block_id = b;
-			for (s = 0; s < o->data.blocks[b].num_of_sensors; s++) {
-				o->data.blocks[b].sensor[s].sensor_id = d[dnum] << 8;
-        			o->data.blocks[b].sensor[s].sensor_id = 
-					o->data.blocks[b].sensor[s].sensor_id | d[dnum+1];
-				o->data.blocks[b].sensor[s].value = d[dnum+2] << 8;
-				o->data.blocks[b].sensor[s].value = o->data.blocks[b].sensor[s].value | d[dnum+3];
-				printk("sensor[%d]-[%d]: id: %u, value: %u\n",
-					b, s, o->data.blocks[b].sensor[s].sensor_id, o->data.blocks[b].sensor[s].value);
-				dnum = dnum + o->data.blocks[b].sensor_length;
-			}
-		}
-		else if (strcmp(o->data.blocks[b].sensor_type, "TEMP") == 0) {
-				
-			o->data.blocks[b].sensor = 
-				kzalloc(sizeof(occ_sensor) * o->data.blocks[b].num_of_sensors, GFP_KERNEL);
-			
-			if (o->data.blocks[b].sensor == NULL) {
-				ret = -ENOMEM;
-				goto abort;
-			}
-			
-			o->temp_block_id = b;
-			for (s = 0; s < o->data.blocks[b].num_of_sensors; s++) {
-				o->data.blocks[b].sensor[s].sensor_id = d[dnum] << 8;
-        			o->data.blocks[b].sensor[s].sensor_id = 
-					o->data.blocks[b].sensor[s].sensor_id | d[dnum+1];
-				o->data.blocks[b].sensor[s].value = d[dnum+2] << 8;
-				o->data.blocks[b].sensor[s].value = o->data.blocks[b].sensor[s].value | d[dnum+3];
-				printk("sensor[%d]-[%d]: id: %u, value: %u\n",
-					b, s, o->data.blocks[b].sensor[s].sensor_id, o->data.blocks[b].sensor[s].value);
-				dnum = dnum + o->data.blocks[b].sensor_length;
-			}
 		}
-		else if (strcmp(o->data.blocks[b].sensor_type, "POWR") == 0) {
-			o->data.blocks[b].powr =
-				kzalloc(sizeof(powr_sensor) * o->data.blocks[b].num_of_sensors, GFP_KERNEL);
-			
-			if (o->data.blocks[b].powr == NULL) {
-				ret = -ENOMEM;
-				goto abort;
-			}
-			o->power_block_id = b;
-			for (s = 0; s< o->data.blocks[b].num_of_sensors; s++) {
-				o->data.blocks[b].powr[s].sensor_id = d[dnum] << 8;
-				o->data.blocks[b].powr[s].sensor_id = o->data.blocks[b].powr[s].sensor_id | d[dnum+1];
-				o->data.blocks[b].powr[s].update_tag = d[dnum+2] << 24;
-				o->data.blocks[b].powr[s].update_tag = o->data.blocks[b].powr[s].update_tag | d[dnum+3] << 16;
-				o->data.blocks[b].powr[s].update_tag = o->data.blocks[b].powr[s].update_tag | d[dnum+4] << 8;
-				o->data.blocks[b].powr[s].update_tag = o->data.blocks[b].powr[s].update_tag | d[dnum+5];
-				o->data.blocks[b].powr[s].accumulator = d[dnum+6] << 24;
-				o->data.blocks[b].powr[s].accumulator = o->data.blocks[b].powr[s].accumulator | d[dnum+7] << 16;
-				o->data.blocks[b].powr[s].accumulator = o->data.blocks[b].powr[s].accumulator | d[dnum+8] << 8;
-				o->data.blocks[b].powr[s].accumulator = o->data.blocks[b].powr[s].accumulator | d[dnum+9];
-				o->data.blocks[b].powr[s].value = d[dnum+10] << 8;
-				o->data.blocks[b].powr[s].value = o->data.blocks[b].powr[s].value | d[dnum+11];
-				
-				printk("sensor[%d]-[%d]: id: %u, value: %u\n",
-					b, s, o->data.blocks[b].sensor[s].sensor_id, o->data.blocks[b].sensor[s].value);
-				
-				dnum = dnum + o->data.blocks[b].sensor_length;
-			}
+		if (blk->sensor_length < h->record_size) {
+			printk("ERROR: %s sensor_length %u < %u\n", blk->sensor_type,
+			       blk->sensor_length, h->record_size);
+			return -EBADMSG;
 		}
-		else {
-      			printk("ERROR: sensor type %s not supported\n", o->data.blocks[b].sensor_type);
-      			continue;
-			/* FIX: ignore wrong sensor type? */
-			//ret = -1;
-			//goto abort;
+		i = h - occ_block_handlers;
+		need[i] = need[i] + blk->num_of_sensors;
+		if (need[i] > h->max) {
+			printk("ERROR: more than %u %s sensors\n", h->max, blk->sensor_type);
+			return -EINVAL;
 		}
 	}
 
-	return ret;
-abort:
-	deinit_occ_resp_buf(o);
-	return ret;  
-}
-
-char fake_occ_rsp[OCC_DATA_MAX] = {
-0x69, 0x00, 0x00, 0x00, 0xa4, 0xc3, 0x00, 0x03, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-0x00, 0x00, 0x00, 0x00, 0x00, 0x6f, 0x70, 0x5f, 0x6f, 0x63, 0x63, 0x5f, 0x31, 0x35, 0x30, 0x37,
-0x31, 0x36, 0x61, 0x00, 0x00, 0x53, 0x45, 0x4e, 0x53, 0x4f, 0x52, 0x04, 0x01, 0x54, 0x45, 0x4d,    
-0x50, 0x00, 0x01, 0x04, 0x0a, 0x00 ,0x6a, 0x00, 0x00, 0x00, 0x6c, 0x00, 0x00, 0x00, 0x6d, 0x00,    
-0x00,0x00,0x6e,0x00, 0x00,0x00,0x6f,0x00, 0x00,0x00,0x70,0x00, 0x00,0x00,0x71,0x00,
-0x00,0x00,0x73,0x00, 0x00,0x00,0x74,0x00, 0x00,0x00,0x75,0x00, 0x00,0x46,0x52,0x45,    
-0x51,0x00,0x01,0x04, 0x0a,0x00,0x76,0x00, 0x00,0x00,0x78,0x00, 0x00,0x00,0x79,0x00,    
-0x00,0x00,0x7a,0x00, 0x00,0x00,0x7b,0x00, 0x00,0x00,0x7c,0x00, 0x00,0x00,0x7d,0x00,    
-0x00,0x00,0x7f,0x00, 0x00,0x00,0x80,0x00, 0x00,0x00,0x81,0x00, 0x00,0x50,0x4f,0x57,    
-0x52,0x00,0x01,0x0c, 0x00,0x43,0x41,0x50, 0x53,0x00,0x01,0x0c, 0x01,0x00,0x00,0x00,    
-0x00,0x04,0xb0,0x09, 0x60,0x04,0x4c,0x00, 0x00,0x17,0xc5,}; 
-
-static int occ_get_all(struct i2c_client *client, occ_response_t *occ_resp)
-{
-	char occ_data[OCC_DATA_MAX];
-	uint16_t num_bytes = 0;
-	int b = 0;
-	int ret = 0;
-
-	//Procedure to access SRAM where OCC data is located	
-	occ_putscom(client, SCOM_OCC_SRAM_WOX, 0x08000000, 0x00000000);
-	occ_putscom(client, SCOM_OCC_SRAM_WAND, 0xFBFFFFFF, 0xFFFFFFFF);
-	occ_putscom(client, SCOM_OCC_SRAM_ADDR, OCC_RESPONSE_ADDR, 0x00000000);
-	occ_putscom(client, SCOM_OCC_SRAM_ADDR, OCC_RESPONSE_ADDR, 0x00000000);
-	
-	occ_getscomb(client, SCOM_OCC_SRAM_DATA, occ_data, 0);
+	/* valid: decode */
+	o->data.blocks = a->blocks;
+	o->temp = &a->temp;
+	o->freq = &a->freq;
+	o->powr = &a->powr;
+	o->caps = &a->caps;
 
-	/* FIXME: use fake data to test driver without hw */
-	printk("i2c-occ: using FAKE occ data\n");
-	memcpy(&occ_data[0], &fake_occ_rsp[0], sizeof(occ_data));
-	
-	num_bytes = get_occdata_length(occ_data);
-	
-	printk("OCC data length: %d\n", num_bytes);
-	
-	if (num_bytes > OCC_DATA_MAX) {
-      		printk("ERROR: OCC data length must be < 4KB\n");
-		return -1;
+	for (b = 0; same && b < o->data.num_of_sensor_blocks; b++) {
+		blk = &a->blocks[b];
+		if (blk->num_of_sensors == 0 || blk->sensor_length == 0)
+			continue;
+		h = occ_block_handler(blk->type);
+		if (h && !h->update(o, blk, d + blk->offset))
+			same = false;
 	}
-	
-	for (b = 8; b < num_bytes; b = b + 8) {
-		occ_getscomb(client, SCOM_OCC_SRAM_DATA, occ_data, b);
+
+	if (!same) {
+		a->temp.num = 0;
+		a->freq.num = 0;
+		a->powr.num = 0;
+		a->caps.num = 0;
+
+		for (b = 0; b < o->data.num_of_sensor_blocks; b++) {
+			blk = &a->blocks[b];
+			blk->first = 0;
+			if (blk->num_of_sensors == 0 || blk->sensor_length == 0)
+				continue;
+			h = occ_block_handler(blk->type);
+			if (h)
+				h->decode(o, blk, d + blk->offset);
+		}
 	}
-	
-	/* FIXME: use fake data to test driver without hw */
-	memcpy(&occ_data[0], &fake_occ_rsp[0], sizeof(occ_data));
-	
-	ret = parse_occ_response(occ_data, occ_resp);
-	
-	return ret;	
-}
 
+	a->num_blocks = o->data.num_of_sensor_blocks;
+	a->values_only = same;
+
+	return 0;
+}
 
-static int occ_update_device(struct device *dev)
+/* parse time; the parser only fills the preallocated arena, no allocations */
+static void occ_account_parse(struct occ_drv_data *data, u64 ns, occ_response_t *o,
+			      struct occ_arena *a)
 {
-	struct occ_drv_data *data = dev_get_drvdata(dev);
-	struct i2c_client *client = data->client;
-	int ret = 0;
+	struct occ_stats *st = &data->stats;
+
+	st->parses++;
+	if (a->values_only)
+		st->parses_values_only++;
+	st->parse_ns = ns;
+	st->parse_ns_total = st->parse_ns_total + ns;
+	if (st->parses == 1 || ns < st->parse_ns_min)
+		st->parse_ns_min = ns;
+	if (ns > st->parse_ns_max)
+		st->parse_ns_max = ns;
+	st->parse_sensors = o->temp->num + o->freq->num + o->powr->num + o->caps->num;
+}
 
-	mutex_lock(&data->update_lock);
+/*
+ * Write command type with len bytes of data to the OCC's command buffer
+ * and ring its doorbell. The OCC tags its response with seq.
+ */
+static int occ_send_cmd(struct i2c_client *client, uint8_t seq, uint8_t type,
+			const uint8_t *cmd_data, uint16_t len)
+{
+	struct occ_drv_data *data = i2c_get_clientdata(client);
+	uint8_t *cmd = data->occ_cmd;
+	int n = OCC_CMD_HDR_SIZE + len;
+	int i;
+
+	if (len > OCC_CMD_DATA_MAX)
+		return -EINVAL;
+
+	cmd[0] = seq;
+	cmd[1] = type;
+	put_unaligned_be16(len, &cmd[2]);
+	memcpy(&cmd[OCC_CMD_HDR_SIZE], cmd_data, len);
+	put_unaligned_be16(occ_checksum(cmd, n), &cmd[n]);
+	n = n + OCC_RESP_CHKSUM_SIZE;
+	memset(&cmd[n], 0, ALIGN(n, 8) - n);
+
+	//Procedure to access SRAM where OCC data is located
+	if (occ_putscom(client, SCOM_OCC_SRAM_WOX, 0x08000000, 0x00000000) ||
+	    occ_putscom(client, SCOM_OCC_SRAM_WAND, 0xFBFFFFFF, 0xFFFFFFFF) ||
+	    occ_putscom(client, SCOM_OCC_SRAM_ADDR, OCC_COMMAND_ADDR, 0x00000000))
+		return -I2C_WRITE_ERROR;
 
-	if (time_after(jiffies, data->last_updated + data->sample_time)
-	    || !data->valid) {
-		dev_dbg(&client->dev, "Starting occ update\n");
+	/* 8 bytes per SRAM_DATA write, in the order occ_getscomb() reads them */
+	for (i = 0; i < n; i = i + 8)
+		if (occ_putscom(client, SCOM_OCC_SRAM_DATA, get_unaligned_be32(&cmd[i]),
+				get_unaligned_be32(&cmd[i + 4])))
+			return -I2C_WRITE_ERROR;
 
-		deinit_occ_resp_buf(data->occ_resp);
-		
-		ret = occ_get_all(client, data->occ_resp);
+	if (occ_putscom(client, SCOM_OCC_ATTN, OCC_ATTN_DATA, 0x00000000))
+		return -I2C_WRITE_ERROR;
+	data->cmd_sent_ns = ktime_get_ns();
+	data->cmd_sent = jiffies;
 
-		data->last_updated = jiffies;
-		data->valid = 1;
-	}
-	mutex_unlock(&data->update_lock);
-	
-	return ret;
+	return 0;
 }
 
-/* ----------------------------------------------------------------------*/
-/* sysfs interface */
-
-static int print_occ_resp(char *buf, occ_response_t *p, int index)
+/*
+ * Wait up to OCC_CMD_TIMEOUT_MS for the OCC to complete its response to
+ * command seq, and leave the first 8 bytes of it in occ_raw. The SRAM
+ * address is left right after them, for reading the rest.
+ */
+static int occ_wait_resp(struct i2c_client *client, uint8_t seq)
 {
-	int i = 0;
-	int j = 0;
-	sensor_data_block *block;
-	occ_sensor *sensor;
-	powr_sensor *powr;
+	struct occ_drv_data *data = i2c_get_clientdata(client);
+	char *occ_data = data->occ_raw;
+	unsigned long timeout = jiffies + msecs_to_jiffies(OCC_CMD_TIMEOUT_MS);
+	int ret;
 
-	printk("occ hwmon all: index: %d\n", index);
-	printk("------------- above are debug message, bellow is real output------------\n");	
-	sprintf(buf, "Dump all sensor data from OCC - Todo\n");
+	for (;;) {
+		if (occ_putscom(client, SCOM_OCC_SRAM_ADDR, OCC_RESPONSE_ADDR, 0x00000000))
+			return -I2C_WRITE_ERROR;
 
-	return 0;
-#if 0
-	sprintf(buf, "num_of_sensor_blocks: %u\n", p->data.num_of_sensor_blocks);
-	for (i = 0; i < p->data.num_of_sensor_blocks; i++)
-	{
-		block = &p->data.blocks[i];
-		if (block == NULL)
-			continue;
+		ret = occ_getscomb(client, SCOM_OCC_SRAM_DATA, occ_data, 0);
+		if (ret)
+			return ret;
 
-		snprintf(buf, sizeof(block->sensor_type), "sensor_type: %s\n", block->sensor_type);
-		sprintf(buf, "num_of_sensors: %u\n", block->num_of_sensors);
-		sprintf(buf, "sensor_length: %u\n", block->sensor_length);
-		
-		if (block->sensor_length == 0)
-			continue;
+		if ((uint8_t)occ_data[0] == seq &&
+		    (uint8_t)occ_data[2] != OCC_RESP_IN_PROGRESS)
+			return 0;
 
-		if (strcmp(block->sensor_type, "TEMP") == 0)
-		{
-			for (j = 0; j < block->num_of_sensors; j++)
-			{
-				sensor = &block->sensor[j];
-				if (sensor == NULL)
-					continue;
-
-				sprintf(buf, "sensor_id: %u\n", sensor->sensor_id);
-				sprintf(buf, "value: %u\n", sensor->value);
-			}
+		if (time_after(jiffies, timeout)) {
+			data->stats.cmd_timeouts++;
+			return -ETIMEDOUT;
 		}
+		usleep_range(OCC_CMD_WAIT_US, 2 * OCC_CMD_WAIT_US);
+	}
+}
 
+static uint8_t occ_next_seq(struct occ_drv_data *data)
+{
+	if (++data->cmd_seq == 0)
+		data->cmd_seq = 1;
 
-		if (strcmp(block->sensor_type, "FREQ") == 0)
-		{
-			for (j = 0; j < block->num_of_sensors; j++)
-			{
-				sensor = &block->sensor[j];
-				if (sensor == NULL)
-					continue;
-				
-				sprintf(buf, "sensor_id: %u\n", sensor->sensor_id);
-				sprintf(buf, "value: %u\n", sensor->value);
-			}
-
-		}
-
-		if (strcmp(block->sensor_type, "POWR") == 0)
-		{
-			for (j = 0; j < block->num_of_sensors; j++)
-			{
-				powr = &block->powr[j];
-				if (powr == NULL)
-					continue;
-
-				sprintf(buf, "sensor_id: %u\n", powr->sensor_id);
-				sprintf(buf, "value: %u\n", powr->value);
-				sprintf(buf, "update_tag: %u\n", powr->update_tag);
-				sprintf(buf, "accumulator: %u\n", powr->accumulator);
-			}
-		}
-	}
-	return 0;
-#endif	
+	return data->cmd_seq;
 }
 
-/* sysfs attributes for hwmon */
-static ssize_t show_occ_data(struct device *dev, struct device_attribute *da, char *buf)
+/*
+ * After occ_wait_resp(): read the rest of the response into occ_raw and
+ * check its checksum. Returns its length, checksum included, or a
+ * negative error.
+ */
+static int occ_read_rest(struct i2c_client *client)
 {
-	struct sensor_device_attribute *attr = to_sensor_dev_attr(da);
-	int n = attr->index; 	
-	struct occ_drv_data *data = dev_get_drvdata(dev);
+	struct occ_drv_data *data = i2c_get_clientdata(client);
+	char *occ_data = data->occ_raw;
+	int num_bytes = 0;
 	int ret = 0;
 
-	ret = occ_update_device(dev);
+	num_bytes = get_occresp_length(occ_data);
+	dev_dbg(&client->dev, "OCC response length: %d\n", num_bytes);
 
-	if (ret != 0);
-	{
-		/* FIXME: to test fake data */
-		//printk("ERROR: cannot get occ sensor data\n");
-		//return ret;
+	if (num_bytes > OCC_DATA_MAX) {
+      		printk("ERROR: OCC data length must be < 4KB\n");
+		return -1;
+	}
+	data->stats.resp_bytes = num_bytes;
+	
+	/* then only the rest of what the OCC reported */
+	if (num_bytes > 8) {
+		ret = occ_getscomb_bulk(client, SCOM_OCC_SRAM_DATA, occ_data, 8,
+					ALIGN(num_bytes, 8) - 8);
+		if (ret)
+			return ret;
 	}
 
-	return print_occ_resp(buf, data->occ_resp, n);
+	if (occ_checksum((uint8_t *)occ_data, num_bytes - OCC_RESP_CHKSUM_SIZE) !=
+	    get_unaligned_be16(&occ_data[num_bytes - OCC_RESP_CHKSUM_SIZE])) {
+		data->stats.checksum_errors++;
+		dev_dbg(&client->dev, "OCC response checksum mismatch\n");
+		return -EBADMSG;
+	}
+
+	return num_bytes;
+}
+
+/* the whole response to command seq, as occ_read_rest() */
+static int occ_read_resp(struct i2c_client *client, uint8_t seq)
+{
+	int ret;
+
+	/* short first read: just enough to see it is ours, and how long it is */
+	ret = occ_wait_resp(client, seq);
+	if (ret)
+		return ret;
+
+	return occ_read_rest(client);
+}
+
+/*
+ * Change detection before the bulk read. The response header is in
+ * occ_raw. A response the size of the published one whose first POWR
+ * update_tag has not moved holds the readings already published: the OCC
+ * refreshes every sensor in one pass, so that tag stands for all of them.
+ * Costs the one or two SRAM words around the tag, where the published
+ * layout puts it.
+ *
+ * 1 if unchanged. 0 if the rest has to be read, with the SRAM address
+ * where occ_read_rest() wants it: untouched if the tag was not looked
+ * at, else put back right after the header, whether the tag moved or
+ * could not be read. A negative error if it could not be put back.
+ */
+static int occ_tag_unchanged(struct i2c_client *client, const occ_response_t *prev)
+{
+	struct occ_drv_data *data = i2c_get_clientdata(client);
+	const sensor_data_block *blk = NULL;
+	char w[16];
+	int off, b;
+
+	if (!prev || !data->pub_len || data->occ_raw[2] != OCC_RESP_SUCCESS ||
+	    get_occresp_length(data->occ_raw) != data->pub_len)
+		return 0;
+
+	for (b = 0; b < prev->data.num_of_sensor_blocks; b++) {
+		blk = &prev->data.blocks[b];
+		if (blk->type == OCC_BLOCK_POWR && blk->num_of_sensors &&
+		    blk->sensor_length >= OCC_POWR_RECORD_SIZE)
+			break;
+	}
+	if (b == prev->data.num_of_sensor_blocks)
+		return 0;
+
+	off = blk->offset + 2;		/* update_tag of its first sensor */
+	if (!occ_putscom(client, SCOM_OCC_SRAM_ADDR, OCC_RESPONSE_ADDR + off / 8 * 8, 0) &&
+	    !occ_getscomb_bulk(client, SCOM_OCC_SRAM_DATA, w, 0, ALIGN(off % 8 + 4, 8)) &&
+	    get_unaligned_be32(&w[off % 8]) == prev->powr->update_tags[blk->first])
+		return 1;
+
+	if (occ_putscom(client, SCOM_OCC_SRAM_ADDR, OCC_RESPONSE_ADDR + 8, 0))
+		return -I2C_WRITE_ERROR;
+	return 0;
+}
+
+/* same bytes as the published response, bar seq and checksum */
+static bool occ_raw_unchanged(struct occ_drv_data *data, int len)
+{
+	return len == data->pub_len &&
+	       !memcmp(data->occ_raw + 1, data->occ_pub + 1, len - 1 - OCC_RESP_CHKSUM_SIZE);
+}
+
+/*
+ * 0 with a new response in occ_resp, OCC_RESP_UNCHANGED if the OCC has
+ * nothing newer than the published one, or a negative error. raw_len is
+ * set whenever occ_raw holds a checked response, parsed or not; it stays
+ * 0 if the update_tag alone showed nothing changed. resp_sent_ns is when
+ * the POLL it answers was sent.
+ */
+static int occ_get_all(struct i2c_client *client, occ_response_t *occ_resp,
+		       struct occ_arena *arena)
+{
+	static const uint8_t poll_data[] = { OCC_POLL_VERSION };
+	struct occ_drv_data *data = i2c_get_clientdata(client);
+	char *occ_data = data->occ_raw;
+	occ_response_t *prev = rcu_dereference_protected(data->occ_resp, 1);
+	int num_bytes = 0;
+	int ret = 0;
+	u64 t0;
+
+	data->raw_len = 0;
+
+	/* ask for a fresh POLL response instead of rereading the last one */
+	ret = occ_send_cmd(client, occ_next_seq(data), OCC_CMD_POLL,
+			   poll_data, sizeof(poll_data));
+	if (ret)
+		return ret;
+
+	ret = occ_wait_resp(client, data->cmd_seq);
+	if (ret)
+		return ret;
+
+	ret = occ_tag_unchanged(client, prev);
+	if (ret < 0)
+		return ret;
+	if (ret) {
+		data->stats.polls_unchanged_tag++;
+		ret = OCC_RESP_UNCHANGED;
+	} else {
+		num_bytes = occ_read_rest(client);
+		if (num_bytes < 0)
+			return num_bytes;
+		data->raw_len = num_bytes;
+
+		/* no tag to go by, or it moved: nothing to parse if no byte did */
+		if (prev && occ_raw_unchanged(data, num_bytes))
+			ret = OCC_RESP_UNCHANGED;
+	}
+	data->resp_sent_ns = data->cmd_sent_ns;
+	data->resp_sent = data->cmd_sent;
+
+	if (ret == OCC_RESP_UNCHANGED)
+		return ret;
+
+	if (occ_data[2] != OCC_RESP_SUCCESS) {
+		dev_dbg(&client->dev, "OCC POLL failed: status 0x%02x\n",
+			(uint8_t)occ_data[2]);
+		return -EPROTO;
+	}
+
+	t0 = ktime_get_ns();
+	ret = parse_occ_response((uint8_t *)occ_data, num_bytes, occ_resp, arena);
+	if (ret)
+		return ret;
+	occ_account_parse(data, ktime_get_ns() - t0, occ_resp, arena);
+
+	return 0;
+}
+
+/*
+ * Commands queued through OCC_IOC_CMD. The poller is the only one on the
+ * bus: it takes the queue at the start of each poll, answers the plain
+ * POLLs with the response it reads anyway, and sends the rest after it.
+ */
+static bool occ_cmd_is_poll(const struct occ_cmd_req *req)
+{
+	return req->ioc.type == OCC_CMD_POLL && req->ioc.data_len == 1 &&
+	       req->ioc.data[0] == OCC_POLL_VERSION;
+}
+
+/* move the queued POLLs, or all other commands, to list; under cmd_lock */
+static void occ_take_cmds(struct occ_drv_data *data, struct list_head *list,
+			  bool polls)
+{
+	struct occ_cmd_req *req, *n;
+
+	list_for_each_entry_safe(req, n, &data->cmd_queue, list) {
+		if (occ_cmd_is_poll(req) != polls)
+			continue;
+		req->taken = true;
+		list_move_tail(&req->list, list);
+	}
+}
+
+/*
+ * Have the poller run delay jiffies from now, unless it is due sooner
+ * already. Under cmd_lock. While suspended it is left for occ_resume().
+ */
+static void occ_queue_poll(struct occ_drv_data *data, unsigned long delay)
+{
+	unsigned long when = jiffies + delay;
+
+	if (data->suspended)
+		return;
+	if (data->poll_queued && !time_before(when, data->poll_due))
+		return;
+
+	data->poll_queued = true;
+	data->poll_due = when;
+	mod_delayed_work(system_wq, &data->poll_work, delay);
+}
+
+/* same, at jiffies due, or right away if that has passed */
+static void occ_queue_poll_at(struct occ_drv_data *data, unsigned long due)
+{
+	occ_queue_poll(data, time_after(due, jiffies) ? due - jiffies : 0);
+}
+
+/* ret: length of the response in resp, or a negative error */
+static void occ_complete_cmd(struct occ_drv_data *data, struct occ_cmd_req *req,
+			     const char *resp, int ret)
+{
+	list_del(&req->list);
+	data->stats.cmd_reqs++;
+
+	if (ret > 0) {
+		memcpy(req->ioc.resp, resp, ret);
+		req->ioc.resp_len = ret;
+		ret = 0;
+	}
+	req->ret = ret;
+	complete(&req->done);
+}
+
+static int occ_run_cmd(struct i2c_client *client, struct occ_cmd_req *req)
+{
+	struct occ_drv_data *data = i2c_get_clientdata(client);
+	int ret;
+
+	ret = occ_send_cmd(client, occ_next_seq(data), req->ioc.type,
+			   req->ioc.data, req->ioc.data_len);
+	if (ret)
+		return ret;
+
+	return occ_read_resp(client, data->cmd_seq);
+}
+
+/*
+ * Queue req for the poller, which completes it. The caller holds the
+ * ring's owner_sem, which keeps data around until then.
+ *
+ * Other commands are sent right away. A POLL joins the one in flight if
+ * there is one, else it waits for the next, which is made due no later
+ * than sample_time after the last: however many callers ask, the bus
+ * sees at most one poll per interval.
+ */
+static int occ_submit_cmd(struct occ_drv_data *data, struct occ_cmd_req *req)
+{
+	bool taken;
+	int ret;
+
+	init_completion(&req->done);
+
+	mutex_lock(&data->update_lock);
+	if (data->removing) {
+		mutex_unlock(&data->update_lock);
+		return -ENODEV;
+	}
+	spin_lock(&data->cmd_lock);
+	list_add_tail(&req->list, &data->cmd_queue);
+	if (!occ_cmd_is_poll(req)) {
+		occ_queue_poll(data, 0);
+	} else if (!data->polling) {
+		occ_queue_poll_at(data, data->poll_started + data->sample_time);
+	}
+	spin_unlock(&data->cmd_lock);
+	mutex_unlock(&data->update_lock);
+
+	ret = wait_for_completion_killable(&req->done);
+	if (ret) {
+		/* still queued: take it back; else the poller is at it */
+		spin_lock(&data->cmd_lock);
+		taken = req->taken;
+		if (!taken)
+			list_del(&req->list);
+		spin_unlock(&data->cmd_lock);
+		if (!taken)
+			return ret;
+		wait_for_completion(&req->done);
+	}
+
+	return req->ret;
+}
+
+/* ----------------------------------------------------------------------*/
+/* character device: mmap'd history of snapshots */
+
+static struct occ_ring *occ_ring_alloc(void)
+{
+	struct occ_ring *ring;
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return NULL;
+
+	ring->size = PAGE_SIZE + OCC_RING_SLOTS * OCC_RING_SLOT_SIZE;
+	ring->mem = vmalloc_user(ring->size);
+	if (!ring->mem) {
+		kfree(ring);
+		return NULL;
+	}
+
+	ring->hdr = ring->mem;
+	ring->hdr->magic = OCC_RING_MAGIC;
+	ring->hdr->version = OCC_RING_VERSION;
+	ring->hdr->hdr_size = sizeof(struct occ_ring_hdr);
+	ring->hdr->slot_size = OCC_RING_SLOT_SIZE;
+	ring->hdr->num_slots = OCC_RING_SLOTS;
+	ring->hdr->data_offset = PAGE_SIZE;
+
+	kref_init(&ring->kref);
+	init_waitqueue_head(&ring->wait);
+	init_rwsem(&ring->owner_sem);
+
+	return ring;
 }
 
-static ssize_t show_occ_temp(struct device *dev, struct device_attribute *da, char *buf)
+static void occ_ring_release(struct kref *kref)
+{
+	struct occ_ring *ring = container_of(kref, struct occ_ring, kref);
+
+	vfree(ring->mem);
+	kfree(ring);
+}
+
+/* called by the poller only */
+static void occ_ring_push(struct occ_ring *ring, const uint8_t *image, int len, uint32_t seq)
+{
+	uint8_t *slot = ring->mem + PAGE_SIZE + (seq % OCC_RING_SLOTS) * OCC_RING_SLOT_SIZE;
+	struct occ_snapshot_hdr *sh = (struct occ_snapshot_hdr *)slot;
+	size_t seq_end = offsetofend(struct occ_snapshot_hdr, seq);
+
+	WRITE_ONCE(sh->seq, 0);
+	smp_wmb();
+	memcpy(slot, image, offsetof(struct occ_snapshot_hdr, seq));
+	memcpy(slot + seq_end, image + seq_end, len - seq_end);
+	smp_wmb();
+	WRITE_ONCE(sh->seq, seq);
+
+	smp_store_release(&ring->hdr->head, seq);
+	wake_up_interruptible_all(&ring->wait);
+}
+
+static int occ_ring_open(struct inode *inode, struct file *filp)
+{
+	/* misc core points private_data at our miscdevice */
+	struct occ_drv_data *data = container_of(filp->private_data,
+						 struct occ_drv_data, miscdev);
+	struct occ_ring_file *rf;
+
+	rf = kzalloc(sizeof(*rf), GFP_KERNEL);
+	if (!rf)
+		return -ENOMEM;
+
+	rf->ring = data->ring;
+	kref_get(&rf->ring->kref);
+	filp->private_data = rf;
+
+	return 0;
+}
+
+static int occ_ring_file_release(struct inode *inode, struct file *filp)
+{
+	struct occ_ring_file *rf = filp->private_data;
+
+	kref_put(&rf->ring->kref, occ_ring_release);
+	kfree(rf);
+
+	return 0;
+}
+
+/*
+ * read() returns the current head as a u32, blocking until it moves past
+ * the one this file returned last; poll() reports the same condition.
+ * The samples themselves are read from the mapping.
+ */
+static ssize_t occ_ring_read(struct file *filp, char __user *buf, size_t count,
+			     loff_t *ppos)
+{
+	struct occ_ring_file *rf = filp->private_data;
+	struct occ_ring *ring = rf->ring;
+	uint32_t head;
+	int ret;
+
+	if (count < sizeof(head))
+		return -EINVAL;
+
+	head = smp_load_acquire(&ring->hdr->head);
+	if (head == rf->seen) {
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		ret = wait_event_interruptible(ring->wait,
+			smp_load_acquire(&ring->hdr->head) != rf->seen ||
+			READ_ONCE(ring->dead));
+		if (ret)
+			return ret;
+
+		head = smp_load_acquire(&ring->hdr->head);
+		if (head == rf->seen)
+			return 0;	/* device gone */
+	}
+
+	if (copy_to_user(buf, &head, sizeof(head)))
+		return -EFAULT;
+	rf->seen = head;
+
+	return sizeof(head);
+}
+
+static unsigned int occ_ring_poll(struct file *filp, poll_table *wait)
+{
+	struct occ_ring_file *rf = filp->private_data;
+	struct occ_ring *ring = rf->ring;
+	unsigned int mask = 0;
+
+	poll_wait(filp, &ring->wait, wait);
+
+	if (smp_load_acquire(&ring->hdr->head) != rf->seen)
+		mask |= POLLIN | POLLRDNORM;
+	if (READ_ONCE(ring->dead))
+		mask |= POLLHUP;
+
+	return mask;
+}
+
+static void occ_ring_vm_open(struct vm_area_struct *vma)
+{
+	struct occ_ring *ring = vma->vm_private_data;
+
+	kref_get(&ring->kref);
+}
+
+static void occ_ring_vm_close(struct vm_area_struct *vma)
+{
+	struct occ_ring *ring = vma->vm_private_data;
+
+	kref_put(&ring->kref, occ_ring_release);
+}
+
+static const struct vm_operations_struct occ_ring_vm_ops = {
+	.open	= occ_ring_vm_open,
+	.close	= occ_ring_vm_close,
+};
+
+static int occ_ring_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct occ_ring_file *rf = filp->private_data;
+	int ret;
+
+	/* consumers only; the poller is the single producer */
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	ret = remap_vmalloc_range(vma, rf->ring->mem, vma->vm_pgoff);
+	if (ret)
+		return ret;
+
+	vma->vm_ops = &occ_ring_vm_ops;
+	vma->vm_private_data = rf->ring;
+	occ_ring_vm_open(vma);
+
+	return 0;
+}
+
+static long occ_ring_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct occ_ring_file *rf = filp->private_data;
+	struct occ_ring *ring = rf->ring;
+	struct occ_cmd_ioc __user *uioc = (struct occ_cmd_ioc __user *)arg;
+	struct occ_cmd_req *req;
+	long ret;
+
+	if (cmd != OCC_IOC_CMD)
+		return -ENOTTY;
+
+	req = kzalloc(sizeof(*req), GFP_KERNEL);
+	if (!req)
+		return -ENOMEM;
+
+	if (copy_from_user(&req->ioc, uioc, offsetof(struct occ_cmd_ioc, resp_len))) {
+		ret = -EFAULT;
+		goto out;
+	}
+	if (req->ioc.data_len > OCC_CMD_DATA_MAX) {
+		ret = -EINVAL;
+		goto out;
+	}
+	/* anything but a plain POLL can change the OCC's state, e.g. a power cap */
+	if (!occ_cmd_is_poll(req) && !(filp->f_mode & FMODE_WRITE) &&
+	    !capable(CAP_SYS_ADMIN)) {
+		ret = -EPERM;
+		goto out;
+	}
+
+	down_read(&ring->owner_sem);
+	ret = ring->owner ? occ_submit_cmd(ring->owner, req) : -ENODEV;
+	up_read(&ring->owner_sem);
+
+	if (!ret && copy_to_user(&uioc->resp_len, &req->ioc.resp_len,
+				 sizeof(req->ioc.resp_len) + req->ioc.resp_len))
+		ret = -EFAULT;
+out:
+	kfree(req);
+	return ret;
+}
+
+static const struct file_operations occ_ring_fops = {
+	.owner		= THIS_MODULE,
+	.open		= occ_ring_open,
+	.release	= occ_ring_file_release,
+	.read		= occ_ring_read,
+	.poll		= occ_ring_poll,
+	.mmap		= occ_ring_mmap,
+	.unlocked_ioctl	= occ_ring_ioctl,
+	.compat_ioctl	= compat_ptr_ioctl,
+	.llseek		= no_llseek,
+};
+
+static uint8_t *occ_put(uint8_t *p, const void *src, size_t len)
+{
+	memcpy(p, src, len);
+	return p + len;
+}
+
+/* serialize the parsed tables into the arena's image, before publishing */
+static void occ_build_snapshot(occ_response_t *o, struct occ_arena *a, uint32_t seq,
+			       u64 sent_ns)
+{
+	struct occ_snapshot_hdr *h = (struct occ_snapshot_hdr *)a->image;
+	uint8_t *p = a->image + sizeof(*h);
+
+	h->magic = OCC_SNAPSHOT_MAGIC;
+	h->version = OCC_SNAPSHOT_VERSION;
+	h->hdr_size = sizeof(*h);
+	h->seq = seq;
+	h->timestamp = sent_ns;
+	h->occ_seq = o->sequence_num;
+	h->occ_state = o->data.occ_state;
+	h->num_temp = o->temp->num;
+	h->num_freq = o->freq->num;
+	h->num_powr = o->powr->num;
+	h->num_caps = o->caps->num;
+
+	p = occ_put(p, o->temp->ids, o->temp->num * sizeof(uint16_t));
+	p = occ_put(p, o->temp->values, o->temp->num * sizeof(uint16_t));
+	p = occ_put(p, o->freq->ids, o->freq->num * sizeof(uint16_t));
+	p = occ_put(p, o->freq->values, o->freq->num * sizeof(uint16_t));
+	p = occ_put(p, o->powr->ids, o->powr->num * sizeof(uint16_t));
+	p = occ_put(p, o->powr->values, o->powr->num * sizeof(uint16_t));
+	p = occ_put(p, o->powr->update_tags, o->powr->num * sizeof(uint32_t));
+	p = occ_put(p, o->powr->accumulators, o->powr->num * sizeof(uint32_t));
+	p = occ_put(p, o->caps->curr_powercap, o->caps->num * sizeof(uint16_t));
+	p = occ_put(p, o->caps->curr_powerreading, o->caps->num * sizeof(uint16_t));
+	p = occ_put(p, o->caps->norm_powercap, o->caps->num * sizeof(uint16_t));
+	p = occ_put(p, o->caps->max_powercap, o->caps->num * sizeof(uint16_t));
+	p = occ_put(p, o->caps->min_powercap, o->caps->num * sizeof(uint16_t));
+	p = occ_put(p, o->caps->user_powerlimit, o->caps->num * sizeof(uint16_t));
+	p = occ_put(p, &seq, sizeof(seq));
+
+	h->size = p - a->image;
+	o->image = a->image;
+	o->image_len = h->size;
+}
+
+/*
+ * One poll, run by the background poller and once by probe: the whole
+ * SCOM/SRAM transfer and parse run here, into the buffer readers cannot
+ * see. The finished response is published with rcu_assign_pointer(), and
+ * the one it replaces is only reused after a grace period, so readers
+ * never block and never see a half-parsed response. Returns 0 once it
+ * has published, OCC_RESP_UNCHANGED, or a negative error.
+ */
+static int occ_poll(struct occ_drv_data *data)
+{
+	struct i2c_client *client = data->client;
+	occ_response_t *resp = data->occ_buf[data->occ_next];
+	ktime_t start = ktime_get();
+	struct occ_cmd_req *req, *n;
+	LIST_HEAD(polls);
+	LIST_HEAD(cmds);
+	int ret = 0;
+
+	dev_dbg(&client->dev, "Starting occ update\n");
+
+	data->stats.xfers = 0;
+	data->stats.msgs = 0;
+	data->stats.bytes = 0;
+	data->stats.resp_bytes = 0;
+
+	spin_lock(&data->cmd_lock);
+	data->poll_queued = false;
+	data->polling = true;
+	data->poll_started = jiffies;
+	occ_take_cmds(data, &cmds, false);
+	spin_unlock(&data->cmd_lock);
+
+	deinit_occ_resp_buf(resp);
+	ret = occ_get_all(client, resp, data->occ_arena[data->occ_next]);
+
+	/*
+	 * POLLs queued up to now get this one's response, before anything
+	 * reuses occ_raw; later ones wait for the next poll.
+	 */
+	spin_lock(&data->cmd_lock);
+	data->polling = false;
+	occ_take_cmds(data, &polls, true);
+	spin_unlock(&data->cmd_lock);
+
+	list_for_each_entry_safe(req, n, &polls, list) {
+		data->stats.cmd_reqs_coalesced++;
+		if (data->raw_len)
+			occ_complete_cmd(data, req, data->occ_raw, data->raw_len);
+		else if (ret == OCC_RESP_UNCHANGED)
+			/* only the tag was read: the published one says the same */
+			occ_complete_cmd(data, req, data->occ_pub, data->pub_len);
+		else
+			/* ret < 0: nothing is copied */
+			occ_complete_cmd(data, req, data->occ_raw, ret);
+	}
+
+	data->stats.polls++;
+	data->stats.last_xfers = data->stats.xfers;
+	data->stats.last_msgs = data->stats.msgs;
+	data->stats.last_bytes = data->stats.bytes;
+	data->stats.last_resp_bytes = data->stats.resp_bytes;
+
+	if (ret == OCC_RESP_UNCHANGED) {
+		/* the OCC updates slower than we poll: poll less */
+		data->stats.polls_unchanged++;
+		data->backoff = min(data->backoff * 2, OCC_MAX_BACKOFF);
+		WRITE_ONCE(rcu_dereference_protected(data->occ_resp, 1)->checked,
+			   data->resp_sent);
+	} else if (ret == 0) {
+		data->backoff = 1;
+		occ_build_snapshot(resp, data->occ_arena[data->occ_next], ++data->snap_seq,
+				   data->resp_sent_ns);
+		data->stats.poll_us[data->stats.poll_us_count % OCC_LAT_WINDOW] =
+			ktime_us_delta(ktime_get(), start);
+		data->stats.publish_ns[data->stats.poll_us_count++ % OCC_LAT_WINDOW] =
+			ktime_get_ns();
+		resp->checked = data->resp_sent;
+		data->stats.sample_age_us = div_u64(ktime_get_ns() - data->resp_sent_ns,
+						    NSEC_PER_USEC);
+		memcpy(data->occ_pub, data->occ_raw, data->raw_len);
+		data->pub_len = data->raw_len;
+		rcu_assign_pointer(data->occ_resp, resp);
+		occ_ring_push(data->ring, resp->image, resp->image_len, data->snap_seq);
+		data->last_updated = jiffies;
+		synchronize_rcu();
+		data->occ_next ^= 1;
+	} else {
+		data->stats.poll_errors++;
+		dev_dbg(&client->dev, "occ update failed: %d\n", ret);
+	}
+
+	/* the OCC is idle now: the other commands, one at a time */
+	list_for_each_entry_safe(req, n, &cmds, list)
+		occ_complete_cmd(data, req, data->occ_raw, occ_run_cmd(client, req));
+
+	return ret;
+}
+
+static void occ_poll_worker(struct work_struct *work)
+{
+	struct occ_drv_data *data = container_of(to_delayed_work(work),
+						 struct occ_drv_data, poll_work);
+
+	occ_poll(data);
+
+	/* a fixed period from the start of this poll, however long it took */
+	spin_lock(&data->cmd_lock);
+	occ_queue_poll_at(data, data->poll_started + data->sample_time * data->backoff);
+	spin_unlock(&data->cmd_lock);
+}
+
+/* ----------------------------------------------------------------------*/
+/* sysfs interface */
+
+/*
+ * Readers always get the published snapshot right away. With revalidate
+ * set, one that finds a poll due, sample_time after the last one started,
+ * has the poller start it now rather than when backoff would; it does not
+ * wait for the result, and the next reader sees it.
+ */
+static void occ_revalidate(struct occ_drv_data *data)
+{
+	if (!revalidate ||
+	    time_before(jiffies, READ_ONCE(data->poll_started) + data->sample_time))
+		return;
+
+	spin_lock(&data->cmd_lock);
+	if (!data->removing && !data->polling &&
+	    !time_before(jiffies, data->poll_started + data->sample_time))
+		occ_queue_poll(data, 0);
+	spin_unlock(&data->cmd_lock);
+}
+
+/* ms since the OCC was last asked and answered with what resp holds */
+static unsigned int occ_age_ms(const occ_response_t *resp)
+{
+	/* a word, unlike a u64 on 32-bit, is read in one go */
+	return jiffies_to_msecs(jiffies - READ_ONCE(resp->checked));
+}
+
+static int print_occ_resp(char *buf, occ_response_t *p, int index)
+{
+	occ_sensor_table *t;
+	powr_sensor_table *powr = p->powr;
+	caps_sensor_table *caps = p->caps;
+	int len = 0;
+	int i = 0;
+
+	len += scnprintf(buf + len, PAGE_SIZE - len, "age_ms: %u\n", occ_age_ms(p));
+	len += scnprintf(buf + len, PAGE_SIZE - len, "num_of_sensor_blocks: %u\n",
+			 p->data.num_of_sensor_blocks);
+
+	t = p->temp;
+	for (i = 0; i < t->num; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "TEMP %u: %u\n",
+				 t->ids[i], t->values[i]);
+
+	t = p->freq;
+	for (i = 0; i < t->num; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "FREQ %u: %u\n",
+				 t->ids[i], t->values[i]);
+
+	for (i = 0; i < powr->num; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				 "POWR %u: %u update_tag: %u accumulator: %u\n",
+				 powr->ids[i], powr->values[i],
+				 powr->update_tags[i], powr->accumulators[i]);
+
+	for (i = 0; i < caps->num; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				 "CAPS %d: curr_powercap: %u curr_powerreading: %u "
+				 "norm_powercap: %u max_powercap: %u min_powercap: %u "
+				 "user_powerlimit: %u\n",
+				 i, caps->curr_powercap[i], caps->curr_powerreading[i],
+				 caps->norm_powercap[i], caps->max_powercap[i],
+				 caps->min_powercap[i], caps->user_powerlimit[i]);
+
+	return len;
+}
+
+/* sysfs attributes for hwmon */
+static ssize_t show_occ_data(struct device *dev, struct device_attribute *da, char *buf)
 {
 	struct sensor_device_attribute *attr = to_sensor_dev_attr(da);
 	int n = attr->index; 	
 	struct occ_drv_data *data = dev_get_drvdata(dev);
+	occ_response_t *resp;
 	int ret = 0;
-	occ_sensor *sensor;
+
+	occ_revalidate(data);
+
+	rcu_read_lock();
+	resp = rcu_dereference(data->occ_resp);
+	if (resp)
+		ret = print_occ_resp(buf, resp, n);
+	else
+		ret = -ENODATA;
+	rcu_read_unlock();
+
+	return ret;
+}
+
+static ssize_t show_occ_freq(struct device *dev, struct device_attribute *da, char *buf)
+{
+	struct sensor_device_attribute *attr = to_sensor_dev_attr(da);
+	int n = attr->index; 	
+	struct occ_drv_data *data = dev_get_drvdata(dev);
+	occ_response_t *resp;
 	int val = 0;
-	
-	ret = occ_update_device(dev);
+	int ret = -ENODATA;
+
+	occ_revalidate(data);
 
-	if (ret != 0);
-	{
-		/* FIXME: to test fake data */
-		//printk("ERROR: cannot get occ sensor data\n");
-		//return ret;
+	rcu_read_lock();
+	resp = rcu_dereference(data->occ_resp);
+	if (resp && n < resp->freq->num) {
+		val = resp->freq->values[n];
+		ret = 0;
 	}
+	rcu_read_unlock();
 
-	printk("temp_block_id: %d, sensor: %d\n", data->occ_resp->temp_block_id, n -1);	
-	sensor = &data->occ_resp->data.blocks[data->occ_resp->temp_block_id].sensor[n - 1];
-	val = sensor->value;
-	printk("temp%d sensor value\n", n, val);
+	if (ret)
+		return ret;
 
-	printk("------------- above are debug message, bellow is real output------------\n");	
 	return sprintf(buf, "%d\n", val);
 }
 
-static ssize_t show_occ_temp_label(struct device *dev, struct device_attribute *da, char *buf)
+static ssize_t show_occ_freq_label(struct device *dev, struct device_attribute *da, char *buf)
 {
 	struct sensor_device_attribute *attr = to_sensor_dev_attr(da);
 	int n = attr->index; 	
 	struct occ_drv_data *data = dev_get_drvdata(dev);
-	int ret = 0;
-	occ_sensor *sensor;
+	occ_response_t *resp;
 	int val = 0;
-	
-	ret = occ_update_device(dev);
+	int ret = -ENODATA;
 
-	if (ret != 0);
-	{
-		/* FIXME: to test fake data */
-		//printk("ERROR: cannot get occ sensor data\n");
-		//return ret;
+	rcu_read_lock();
+	resp = rcu_dereference(data->occ_resp);
+	if (resp && n < resp->freq->num) {
+		val = resp->freq->ids[n];
+		ret = 0;
 	}
-	
-	sensor = &data->occ_resp->data.blocks[data->occ_resp->temp_block_id].sensor[n - 1];
-	val = sensor->sensor_id;
-	printk("temp%d sensor id\n", n, val);
-	printk("------------- above are debug message, bellow is real output------------\n");	
-	
+	rcu_read_unlock();
+
+	if (ret)
+		return ret;
+
 	return sprintf(buf, "sensor id: %d\n", val);
 }
 
+static int occ_cmp_uint(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a;
+	unsigned int y = *(const unsigned int *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* nearest-rank percentile of n sorted values */
+static unsigned int occ_percentile(const unsigned int *v, int n, int pct)
+{
+	return n ? v[DIV_ROUND_UP(n * pct, 100) - 1] : 0;
+}
+
+static ssize_t show_occ_stats(struct device *dev, struct device_attribute *da, char *buf)
+{
+	struct occ_drv_data *data = dev_get_drvdata(dev);
+	struct occ_stats *st = &data->stats;
+	u64 avg = st->parses ? div64_u64(st->parse_ns_total, st->parses) : 0;
+	unsigned int *lat;
+	int n = min_t(unsigned long, st->poll_us_count, OCC_LAT_WINDOW);
+	u64 newest = n ? st->publish_ns[(st->poll_us_count - 1) % OCC_LAT_WINDOW] : 0;
+	u64 oldest = n ? st->publish_ns[(st->poll_us_count - n) % OCC_LAT_WINDOW] : 0;
+	u64 rate = newest > oldest ? div64_u64((u64)(n - 1) * NSEC_PER_SEC, newest - oldest) : 0;
+	ssize_t ret;
+
+	/* too big for the stack */
+	lat = kcalloc(OCC_LAT_WINDOW, sizeof(*lat), GFP_KERNEL);
+	if (!lat)
+		return -ENOMEM;
+	memcpy(lat, st->poll_us, OCC_LAT_WINDOW * sizeof(*lat));
+	sort(lat, n, sizeof(lat[0]), occ_cmp_uint, NULL);
+
+	ret = sprintf(buf,
+		       "polls: %lu\n"
+		       "poll_errors: %lu\n"
+		       "polls_unchanged: %lu\n"
+		       "polls_unchanged_tag: %lu\n"
+		       "cmd_timeouts: %lu\n"
+		       "checksum_errors: %lu\n"
+		       "cmd_reqs: %lu\n"
+		       "cmd_reqs_coalesced: %lu\n"
+		       "sample_age_us: %u\n"
+		       "xfers_per_poll: %u\n"
+		       "msgs_per_poll: %u\n"
+		       "bytes_per_poll: %u\n"
+		       "resp_bytes: %u\n"
+		       "parses: %lu\n"
+		       "parses_values_only: %lu\n"
+		       "parse_sensors: %u\n"
+		       "parse_ns: %llu\n"
+		       "parse_ns_min: %llu\n"
+		       "parse_ns_avg: %llu\n"
+		       "parse_ns_max: %llu\n"
+		       "parse_ns_per_sensor: %llu\n"
+		       "poll_us_samples: %d\n"
+		       "poll_us_p50: %u\n"
+		       "poll_us_p90: %u\n"
+		       "poll_us_p99: %u\n"
+		       "poll_us_max: %u\n"
+		       "samples_per_sec: %llu\n",
+		       st->polls, st->poll_errors, st->polls_unchanged,
+		       st->polls_unchanged_tag, st->cmd_timeouts,
+		       st->checksum_errors, st->cmd_reqs, st->cmd_reqs_coalesced,
+		       st->sample_age_us, st->last_xfers,
+		       st->last_msgs, st->last_bytes, st->last_resp_bytes,
+		       st->parses, st->parses_values_only, st->parse_sensors, st->parse_ns,
+		       st->parse_ns_min, avg, st->parse_ns_max,
+		       st->parse_sensors ? div_u64(avg, st->parse_sensors) : 0,
+		       n, occ_percentile(lat, n, 50), occ_percentile(lat, n, 90),
+		       occ_percentile(lat, n, 99), n ? lat[n - 1] : 0, rate);
+	kfree(lat);
+
+	return ret;
+}
+
+static ssize_t show_occ_age(struct device *dev, struct device_attribute *da, char *buf)
+{
+	struct occ_drv_data *data = dev_get_drvdata(dev);
+	occ_response_t *resp;
+	unsigned int age = 0;
+	int ret = -ENODATA;
+
+	occ_revalidate(data);
+
+	rcu_read_lock();
+	resp = rcu_dereference(data->occ_resp);
+	if (resp) {
+		age = occ_age_ms(resp);
+		ret = 0;
+	}
+	rcu_read_unlock();
+
+	if (ret)
+		return ret;
+
+	return sprintf(buf, "%u\n", age);
+}
 
 static SENSOR_DEVICE_ATTR(all, S_IRUGO, show_occ_data, NULL, 0);
-static SENSOR_DEVICE_ATTR(temp1_input, S_IRUGO, show_occ_temp, NULL, 1);
-static SENSOR_DEVICE_ATTR(temp2_input, S_IRUGO, show_occ_temp, NULL, 2);
-static SENSOR_DEVICE_ATTR(temp3_input, S_IRUGO, show_occ_temp, NULL, 3);
-static SENSOR_DEVICE_ATTR(temp4_input, S_IRUGO, show_occ_temp, NULL, 4);
-static SENSOR_DEVICE_ATTR(temp5_input, S_IRUGO, show_occ_temp, NULL, 5);
-static SENSOR_DEVICE_ATTR(temp6_input, S_IRUGO, show_occ_temp, NULL, 6);
-static SENSOR_DEVICE_ATTR(temp7_input, S_IRUGO, show_occ_temp, NULL, 7);
-static SENSOR_DEVICE_ATTR(temp8_input, S_IRUGO, show_occ_temp, NULL, 8);
-static SENSOR_DEVICE_ATTR(temp9_input, S_IRUGO, show_occ_temp, NULL, 9);
-static SENSOR_DEVICE_ATTR(temp10_input, S_IRUGO, show_occ_temp, NULL, 10);
-static SENSOR_DEVICE_ATTR(temp1_label, S_IRUGO, show_occ_temp_label, NULL, 1);
-static SENSOR_DEVICE_ATTR(temp2_label, S_IRUGO, show_occ_temp_label, NULL, 2);
-static SENSOR_DEVICE_ATTR(temp3_label, S_IRUGO, show_occ_temp_label, NULL, 3);
-static SENSOR_DEVICE_ATTR(temp4_label, S_IRUGO, show_occ_temp_label, NULL, 4);
-static SENSOR_DEVICE_ATTR(temp5_label, S_IRUGO, show_occ_temp_label, NULL, 5);
-static SENSOR_DEVICE_ATTR(temp6_label, S_IRUGO, show_occ_temp_label, NULL, 6);
-static SENSOR_DEVICE_ATTR(temp7_label, S_IRUGO, show_occ_temp_label, NULL, 7);
-static SENSOR_DEVICE_ATTR(temp8_label, S_IRUGO, show_occ_temp_label, NULL, 8);
-static SENSOR_DEVICE_ATTR(temp9_label, S_IRUGO, show_occ_temp_label, NULL, 9);
-static SENSOR_DEVICE_ATTR(temp10_label, S_IRUGO, show_occ_temp_label, NULL, 10);
+static SENSOR_DEVICE_ATTR(age_ms, S_IRUGO, show_occ_age, NULL, 0);
+static SENSOR_DEVICE_ATTR(stats, S_IRUGO, show_occ_stats, NULL, 0);
+
+/* one read returns the whole latest snapshot */
+static ssize_t occ_snapshot_read(struct file *filp, struct kobject *kobj,
+				 struct bin_attribute *attr, char *buf,
+				 loff_t off, size_t count)
+{
+	struct occ_drv_data *data = dev_get_drvdata(kobj_to_dev(kobj));
+	occ_response_t *resp;
+	ssize_t ret = 0;
+
+	occ_revalidate(data);
+
+	rcu_read_lock();
+	resp = rcu_dereference(data->occ_resp);
+	if (!resp) {
+		ret = -ENODATA;
+	} else if (off < resp->image_len) {
+		ret = min_t(size_t, count, resp->image_len - off);
+		memcpy(buf, resp->image + off, ret);
+	}
+	rcu_read_unlock();
+
+	return ret;
+}
+
+static struct bin_attribute bin_attr_snapshot = {
+	.attr	= { .name = "snapshot", .mode = S_IRUGO },
+	.size	= OCC_SNAPSHOT_MAX,
+	.read	= occ_snapshot_read,
+};
 
 static struct attribute *occ_attrs[] = {
 	&sensor_dev_attr_all.dev_attr.attr,
-	&sensor_dev_attr_temp1_input.dev_attr.attr,
-	&sensor_dev_attr_temp2_input.dev_attr.attr,
-	&sensor_dev_attr_temp3_input.dev_attr.attr,
-	&sensor_dev_attr_temp4_input.dev_attr.attr,
-	&sensor_dev_attr_temp5_input.dev_attr.attr,
-	&sensor_dev_attr_temp6_input.dev_attr.attr,
-	&sensor_dev_attr_temp7_input.dev_attr.attr,
-	&sensor_dev_attr_temp8_input.dev_attr.attr,
-	&sensor_dev_attr_temp9_input.dev_attr.attr,
-	&sensor_dev_attr_temp10_input.dev_attr.attr,
-	&sensor_dev_attr_temp1_label.dev_attr.attr,
-	&sensor_dev_attr_temp2_label.dev_attr.attr,
-	&sensor_dev_attr_temp3_label.dev_attr.attr,
-	&sensor_dev_attr_temp4_label.dev_attr.attr,
-	&sensor_dev_attr_temp5_label.dev_attr.attr,
-	&sensor_dev_attr_temp6_label.dev_attr.attr,
-	&sensor_dev_attr_temp7_label.dev_attr.attr,
-	&sensor_dev_attr_temp8_label.dev_attr.attr,
-	&sensor_dev_attr_temp9_label.dev_attr.attr,
-	&sensor_dev_attr_temp10_label.dev_attr.attr,
+	&sensor_dev_attr_age_ms.dev_attr.attr,
+	&sensor_dev_attr_stats.dev_attr.attr,
+
+	NULL
+};
 
+static struct bin_attribute *occ_bin_attrs[] = {
+	&bin_attr_snapshot,
 	NULL
 };
-ATTRIBUTE_GROUPS(occ);
+
+static const struct attribute_group occ_group = {
+	.attrs = occ_attrs,
+	.bin_attrs = occ_bin_attrs,
+};
+
+/* hwmon channel callbacks: the channel number is the index into the table */
+static umode_t occ_is_visible(const void *drvdata, enum hwmon_sensor_types type,
+			      u32 attr, int channel)
+{
+	if (type == hwmon_chip && attr == hwmon_chip_update_interval)
+		return S_IRUGO | S_IWUSR;
+
+	return S_IRUGO;
+}
+
+/* hwmon wants uW: past 2147 W that overflows a 32-bit long */
+static long occ_watts_to_uw(u64 w)
+{
+	return min_t(u64, w * 1000000, LONG_MAX);
+}
+
+static int occ_hwmon_read(struct device *dev, enum hwmon_sensor_types type,
+			  u32 attr, int channel, long *val)
+{
+	struct occ_drv_data *data = dev_get_drvdata(dev);
+	occ_response_t *resp;
+	powr_sensor_table *p;
+	int ret = 0;
+
+	if (type == hwmon_chip) {
+		*val = jiffies_to_msecs(data->sample_time);
+		return 0;
+	}
+
+	occ_revalidate(data);
+
+	rcu_read_lock();
+	resp = rcu_dereference(data->occ_resp);
+	if (!resp) {
+		ret = -ENODATA;
+		goto out;
+	}
+
+	switch (type) {
+	/* the channels are the sensors of the first poll, in order */
+	case hwmon_temp:
+		if (channel >= resp->temp->num ||
+		    resp->temp->ids[channel] != data->temp_ids[channel]) {
+			ret = -ENODATA;
+			break;
+		}
+		/* OCC reports degrees C */
+		*val = resp->temp->values[channel] * 1000;
+		break;
+	case hwmon_power:
+		p = resp->powr;
+		if (channel >= p->num || p->ids[channel] != data->power_ids[channel]) {
+			ret = -ENODATA;
+			break;
+		}
+		/* OCC reports W, the accumulator sums one reading per update */
+		if (attr == hwmon_power_average)
+			*val = p->update_tags[channel] ?
+			       occ_watts_to_uw(p->accumulators[channel] / p->update_tags[channel]) : 0;
+		else
+			*val = occ_watts_to_uw(p->values[channel]);
+		break;
+	default:
+		ret = -EOPNOTSUPP;
+		break;
+	}
+out:
+	rcu_read_unlock();
+
+	return ret;
+}
+
+static int occ_hwmon_read_string(struct device *dev, enum hwmon_sensor_types type,
+				 u32 attr, int channel, const char **str)
+{
+	struct occ_drv_data *data = dev_get_drvdata(dev);
+
+	if (type == hwmon_temp)
+		*str = data->temp_labels[channel];
+	else if (type == hwmon_power)
+		*str = data->power_labels[channel];
+	else
+		return -EOPNOTSUPP;
+
+	return 0;
+}
+
+static int occ_set_update_interval(struct occ_drv_data *data, long val)
+{
+	val = clamp_val(val, OCC_UPDATE_INTERVAL_MIN, OCC_UPDATE_INTERVAL_MAX);
+
+	mutex_lock(&data->update_lock);
+	data->sample_time = msecs_to_jiffies(val);
+	data->backoff = 1;
+	if (!data->removing) {
+		/* restart the period, even if that is later than due now */
+		spin_lock(&data->cmd_lock);
+		data->poll_queued = false;
+		occ_queue_poll(data, data->sample_time);
+		spin_unlock(&data->cmd_lock);
+	}
+	mutex_unlock(&data->update_lock);
+
+	return 0;
+}
+
+static int occ_hwmon_write(struct device *dev, enum hwmon_sensor_types type,
+			   u32 attr, int channel, long val)
+{
+	struct occ_drv_data *data = dev_get_drvdata(dev);
+
+	if (type == hwmon_chip && attr == hwmon_chip_update_interval)
+		return occ_set_update_interval(data, val);
+
+	return -EOPNOTSUPP;
+}
+
+static const struct hwmon_ops occ_hwmon_ops = {
+	.is_visible = occ_is_visible,
+	.read = occ_hwmon_read,
+	.read_string = occ_hwmon_read_string,
+	.write = occ_hwmon_write,
+};
+
+static const u32 occ_chip_config[] = {
+	HWMON_C_UPDATE_INTERVAL,
+	0
+};
+
+/* labels are fixed at registration, from the ids of the first poll */
+static char (*occ_make_labels(uint16_t *ids, int num))[OCC_LABEL_LEN]
+{
+	char (*labels)[OCC_LABEL_LEN];
+	int i;
+
+	labels = kcalloc(num, OCC_LABEL_LEN, GFP_KERNEL);
+	if (!labels)
+		return NULL;
+
+	for (i = 0; i < num; i++)
+		snprintf(labels[i], OCC_LABEL_LEN, "sensor id: %u", ids[i]);
+
+	return labels;
+}
+
+static uint16_t *occ_copy_ids(const uint16_t *ids, int num)
+{
+	uint16_t *copy;
+
+	copy = kcalloc(num, sizeof(*copy), GFP_KERNEL);
+	if (copy)
+		memcpy(copy, ids, num * sizeof(*copy));
+
+	return copy;
+}
+
+static u32 *occ_make_config(int num, u32 flags)
+{
+	u32 *config;
+	int i;
+
+	config = kcalloc(num + 1, sizeof(u32), GFP_KERNEL);
+	if (!config)
+		return NULL;
+
+	for (i = 0; i < num; i++)
+		config[i] = flags;
+
+	return config;
+}
+
+/* FREQ has no hwmon sensor type, so it gets plain freqN_input/label files */
+static int occ_make_freq_group(struct occ_drv_data *data, int num)
+{
+	struct occ_freq_attr *fa;
+	struct attribute **attrs;
+	int i;
+
+	fa = kcalloc(num, sizeof(*fa), GFP_KERNEL);
+	attrs = kcalloc(2 * num + 1, sizeof(*attrs), GFP_KERNEL);
+	data->freq_attrs = fa;
+	data->freq_group.attrs = attrs;
+	if (!fa || !attrs)
+		return -ENOMEM;
+
+	for (i = 0; i < num; i++) {
+		snprintf(fa[i].input_name, sizeof(fa[i].input_name), "freq%d_input", i + 1);
+		sysfs_attr_init(&fa[i].input.dev_attr.attr);
+		fa[i].input.dev_attr.attr.name = fa[i].input_name;
+		fa[i].input.dev_attr.attr.mode = S_IRUGO;
+		fa[i].input.dev_attr.show = show_occ_freq;
+		fa[i].input.index = i;
+
+		snprintf(fa[i].label_name, sizeof(fa[i].label_name), "freq%d_label", i + 1);
+		sysfs_attr_init(&fa[i].label.dev_attr.attr);
+		fa[i].label.dev_attr.attr.name = fa[i].label_name;
+		fa[i].label.dev_attr.attr.mode = S_IRUGO;
+		fa[i].label.dev_attr.show = show_occ_freq_label;
+		fa[i].label.index = i;
+
+		attrs[2 * i] = &fa[i].input.dev_attr.attr;
+		attrs[2 * i + 1] = &fa[i].label.dev_attr.attr;
+	}
+
+	return 0;
+}
+
+/* what occ_register_hwmon() allocated, once no device uses it */
+static void occ_free_hwmon_tables(struct occ_drv_data *data)
+{
+	kfree(data->temp_ch.config);
+	kfree(data->power_ch.config);
+	kfree(data->temp_labels);
+	kfree(data->power_labels);
+	kfree(data->temp_ids);
+	kfree(data->power_ids);
+	kfree(data->freq_attrs);
+	kfree(data->freq_group.attrs);
+
+	data->temp_ch.config = NULL;
+	data->power_ch.config = NULL;
+	data->temp_labels = NULL;
+	data->power_labels = NULL;
+	data->temp_ids = NULL;
+	data->power_ids = NULL;
+	data->freq_attrs = NULL;
+	data->freq_group.attrs = NULL;
+}
+
+/*
+ * Called by probe with the first POLL's response: one hwmon channel per
+ * TEMP and POWR sensor, one freqN pair per FREQ sensor. hwmon takes the
+ * channels at registration, once; a channel whose sensor id has changed
+ * since reads -ENODATA.
+ */
+static int occ_register_hwmon(struct occ_drv_data *data, occ_response_t *resp)
+{
+	struct device *dev = &data->client->dev;
+	int ntemp = resp->temp->num;
+	int npowr = resp->powr->num;
+	int nfreq = resp->freq->num;
+	int ret = -ENOMEM;
+	int c = 0;
+	int g = 0;
+	u32 *config;
+
+	data->chip_ch.type = hwmon_chip;
+	data->chip_ch.config = occ_chip_config;
+	data->channels[c++] = &data->chip_ch;
+
+	if (ntemp) {
+		config = occ_make_config(ntemp, HWMON_T_INPUT | HWMON_T_LABEL);
+		data->temp_labels = occ_make_labels(resp->temp->ids, ntemp);
+		data->temp_ids = occ_copy_ids(resp->temp->ids, ntemp);
+		data->temp_ch.config = config;
+		if (!config || !data->temp_labels || !data->temp_ids)
+			goto fail;
+		data->temp_ch.type = hwmon_temp;
+		data->channels[c++] = &data->temp_ch;
+	}
+
+	if (npowr) {
+		config = occ_make_config(npowr,
+					 HWMON_P_INPUT | HWMON_P_LABEL | HWMON_P_AVERAGE);
+		data->power_labels = occ_make_labels(resp->powr->ids, npowr);
+		data->power_ids = occ_copy_ids(resp->powr->ids, npowr);
+		data->power_ch.config = config;
+		if (!config || !data->power_labels || !data->power_ids)
+			goto fail;
+		data->power_ch.type = hwmon_power;
+		data->channels[c++] = &data->power_ch;
+	}
+	data->channels[c] = NULL;
+
+	data->groups[g++] = &occ_group;
+	if (nfreq) {
+		if (occ_make_freq_group(data, nfreq))
+			goto fail;
+		data->groups[g++] = &data->freq_group;
+	}
+	data->groups[g] = NULL;
+
+	data->chip.ops = &occ_hwmon_ops;
+	data->chip.info = data->channels;
+
+	data->hwmon_dev = hwmon_device_register_with_info(dev, data->client->name, data,
+							  &data->chip, data->groups);
+	if (IS_ERR(data->hwmon_dev)) {
+		ret = PTR_ERR(data->hwmon_dev);
+		goto fail;
+	}
+
+	dev_info(dev, "%s: %d temp, %d freq, %d power sensors\n",
+		 dev_name(data->hwmon_dev), ntemp, nfreq, npowr);
+
+	return 0;
+
+fail:
+	occ_free_hwmon_tables(data);
+	return ret;
+}
 
 /*-----------------------------------------------------------------------*/
 /* device probe and removal */
@@ -709,46 +2432,102 @@ enum occ_type {
 	occ_id,
 };
 
+static void occ_free_arena(void *arena)
+{
+	kvfree(arena);
+}
+
 static int occ_probe(struct i2c_client *client, const struct i2c_device_id *id)
 {
 	struct device *dev = &client->dev;
 	struct occ_drv_data *data;
 	unsigned long funcs;
+	int ret, i;
 
 	data = devm_kzalloc(dev, sizeof(struct occ_drv_data), GFP_KERNEL);
 	if (!data)
 		return -ENOMEM;
 
+	/* everything a poll touches is per device, so OCCs poll in parallel */
+	data->occ_buf[0] = devm_kzalloc(dev, sizeof(occ_response_t), GFP_KERNEL);
+	data->occ_buf[1] = devm_kzalloc(dev, sizeof(occ_response_t), GFP_KERNEL);
+	if (!data->occ_buf[0] || !data->occ_buf[1])
+		return -ENOMEM;
+
+	/* tens of KB each: they need not be physically contiguous */
+	for (i = 0; i < ARRAY_SIZE(data->occ_arena); i++) {
+		data->occ_arena[i] = kvzalloc(sizeof(struct occ_arena), GFP_KERNEL);
+		if (!data->occ_arena[i])
+			return -ENOMEM;
+		ret = devm_add_action_or_reset(dev, occ_free_arena, data->occ_arena[i]);
+		if (ret)
+			return ret;
+	}
+
 	data->client = client;
-	data->occ_resp = &occ_resp;
 	i2c_set_clientdata(client, data);
 	mutex_init(&data->update_lock);
+	spin_lock_init(&data->cmd_lock);
+	INIT_LIST_HEAD(&data->cmd_queue);
 	data->sample_time = HZ;
+	data->backoff = 1;
+	INIT_DELAYED_WORK(&data->poll_work, occ_poll_worker);
 
 	//if (i2cdev_check_addr(client->adapter, OCC_I2C_ADDR))
 	//	return -EBUSY;
 
 	client->addr = OCC_I2C_ADDR;
-	
-	/* configure the driver */
-	//dev_dbg(dev, "occ i2c register hwmon\n");
-	printk("occ i2c register hwmon\n");
-
-	data->hwmon_dev = hwmon_device_register_with_groups(dev, client->name,
-							    data, occ_groups);
-	if (IS_ERR(data->hwmon_dev))
-		return PTR_ERR(data->hwmon_dev);
-
-	//dev_info(dev, "%s: sensor '%s'\n",
-	//	 dev_name(data->hwmon_dev), client->name);
-	printk("%s: sensor '%s'\n",
-		 dev_name(data->hwmon_dev), client->name);
 
 	funcs = i2c_get_functionality(client->adapter);
 	
 	dev_info(dev, "i2c adaptor supports function: 0x%lx\n", funcs); 
+	data->bulk_read = !!(funcs & I2C_FUNC_I2C);
+
+	data->sim = occ_sim_create(dev);
+	if (IS_ERR(data->sim))
+		return PTR_ERR(data->sim);
+	if (data->sim) {
+		data->bulk_read = true;
+		dev_info(dev, "using a simulated OCC\n");
+	}
 
 	occ_check_i2c_errors(client);
+
+	data->ring = occ_ring_alloc();
+	if (!data->ring)
+		return -ENOMEM;
+	data->ring->owner = data;
+
+	/*
+	 * The hwmon channels are the sensors the OCC reports, so wait for its
+	 * first POLL response, OCC_CMD_TIMEOUT_MS at most. Nothing else can
+	 * reach the OCC before the device is registered below.
+	 */
+	ret = occ_poll(data);
+	if (!ret)
+		ret = occ_register_hwmon(data, rcu_dereference_protected(data->occ_resp, 1));
+	if (ret) {
+		dev_err(dev, "no sensors from the first POLL: %d\n", ret);
+		kref_put(&data->ring->kref, occ_ring_release);
+		return ret < 0 ? ret : -EIO;
+	}
+
+	data->miscdev.minor = MISC_DYNAMIC_MINOR;
+	data->miscdev.name = devm_kasprintf(dev, GFP_KERNEL, "occ-%s", dev_name(dev));
+	data->miscdev.fops = &occ_ring_fops;
+	data->miscdev.parent = dev;
+	ret = data->miscdev.name ? misc_register(&data->miscdev) : -ENOMEM;
+	if (ret) {
+		kref_put(&data->ring->kref, occ_ring_release);
+		hwmon_device_unregister(data->hwmon_dev);
+		occ_free_hwmon_tables(data);
+		return ret;
+	}
+
+	/* then every sample_time from the first */
+	spin_lock(&data->cmd_lock);
+	occ_queue_poll_at(data, data->poll_started + data->sample_time);
+	spin_unlock(&data->cmd_lock);
 	//dev_info(dev, "occ i2c driver ready\n");
 	printk("occ i2c driver ready\n");
 
@@ -759,10 +2538,29 @@ static int occ_remove(struct i2c_client *client)
 {
 	struct occ_drv_data *data = i2c_get_clientdata(client);
 
-	/* free allocated sensor memory */	
-	deinit_occ_resp_buf(data->occ_resp);
+	/* keep update_interval writes and readers from re-arming the poller */
+	mutex_lock(&data->update_lock);
+	spin_lock(&data->cmd_lock);
+	data->removing = true;
+	spin_unlock(&data->cmd_lock);
+	mutex_unlock(&data->update_lock);
+
+	/* let OCC_IOC_CMDs in progress finish; the poller still serves them */
+	down_write(&data->ring->owner_sem);
+	data->ring->owner = NULL;
+	up_write(&data->ring->owner_sem);
+
+	cancel_delayed_work_sync(&data->poll_work);
 
 	hwmon_device_unregister(data->hwmon_dev);
+	occ_free_hwmon_tables(data);
+
+	/* open files and mappings keep the ring itself alive */
+	misc_deregister(&data->miscdev);
+	WRITE_ONCE(data->ring->dead, true);
+	wake_up_interruptible_all(&data->ring->wait);
+	kref_put(&data->ring->kref, occ_ring_release);
+
 	return 0;
 }
 
@@ -773,17 +2571,35 @@ static const struct i2c_device_id occ_ids[] = {
 MODULE_DEVICE_TABLE(i2c, occ_ids);
 
 #ifdef CONFIG_PM
+/* the poller stays off the bus until resume; queued commands wait for it */
 static int occ_suspend(struct device *dev)
 {
-	//struct i2c_client *client = to_i2c_client(dev);
-	/* TODO */
+	struct occ_drv_data *data = dev_get_drvdata(dev);
+
+	spin_lock(&data->cmd_lock);
+	data->suspended = true;
+	spin_unlock(&data->cmd_lock);
+
+	cancel_delayed_work_sync(&data->poll_work);
+
+	spin_lock(&data->cmd_lock);
+	data->poll_queued = false;
+	spin_unlock(&data->cmd_lock);
+
 	return 0;
 }
 
+/* what was published is from before the suspend: poll right away */
 static int occ_resume(struct device *dev)
 {
-	//struct i2c_client *client = to_i2c_client(dev);
-	/* TODO */
+	struct occ_drv_data *data = dev_get_drvdata(dev);
+
+	spin_lock(&data->cmd_lock);
+	data->suspended = false;
+	if (!data->removing)
+		occ_queue_poll(data, 0);
+	spin_unlock(&data->cmd_lock);
+
 	return 0;
 }
 
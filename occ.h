@@ -0,0 +1,64 @@
+/*
+ * BMC OCC HWMON driver - OCC command/response format and SCOM registers,
+ * shared by the driver and the simulated OCC.
+ *
+ * Copyright (c) 2015 IBM (Alvin Wang, Li Yi)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __OCC_H__
+#define __OCC_H__
+
+#define OCC_DATA_MAX 4096 /* 4KB at most */
+#define OCC_RESP_HDR_SIZE 5	/* sequence_num .. data_length */
+#define OCC_RESP_CHKSUM_SIZE 2
+#define OCC_POLL_HDR_SIZE 45	/* response header + fixed poll data */
+
+/*
+ * Commands go to the OCC's command buffer as seq, type, 2-byte
+ * data_length, data and a checksum like the response's. The response to
+ * one starts with the same seq, and rtn_status OCC_RESP_IN_PROGRESS
+ * until it is complete.
+ */
+#define OCC_CMD_POLL		0x00
+#define OCC_POLL_VERSION	0x10	/* the POLL command's one data byte */
+#define OCC_CMD_HDR_SIZE	4
+#define OCC_CMD_DATA_MAX	128
+#define OCC_CMD_MAX		ALIGN(OCC_CMD_HDR_SIZE + OCC_CMD_DATA_MAX + \
+				      OCC_RESP_CHKSUM_SIZE, 8)
+#define OCC_RESP_SUCCESS	0x00
+#define OCC_RESP_INVALID_CMD	0x11
+#define OCC_RESP_CHKSUM_FAIL	0x14
+#define OCC_RESP_IN_PROGRESS	0xFF
+#define OCC_CMD_TIMEOUT_MS	500
+#define OCC_CMD_WAIT_US		500	/* between looks at the response */
+
+/* wire sizes of the sensor records, used to bound the tables */
+#define OCC_SENSOR_RECORD_SIZE	4
+#define OCC_POWR_RECORD_SIZE	12
+#define OCC_CAPS_RECORD_SIZE	12
+#define OCC_MAX_BLOCKS		255	/* num_of_sensor_blocks is a u8 */
+
+/* registers behind the P8 i2c slave */
+#define I2C_STATUS_REG 0x000d0001
+#define I2C_ERROR_REG  0x000d0002
+
+#define SCOM_OCC_SRAM_WOX  0x0006B013
+#define SCOM_OCC_SRAM_WAND 0x0006B012
+#define SCOM_OCC_SRAM_ADDR 0x0006B010
+#define SCOM_OCC_SRAM_DATA 0x0006B015
+#define SCOM_OCC_ATTN      0x0006B035
+#define OCC_COMMAND_ADDR 0xFFFF6000
+#define OCC_RESPONSE_ADDR 0xFFFF7000
+#define OCC_ATTN_DATA 0x20010000	/* to SCOM_OCC_ATTN: a command is waiting */
+
+#endif /* __OCC_H__ */
@@ -0,0 +1,469 @@
+/*
+ * BMC OCC HWMON driver - simulated OCC, for testing without the hardware.
+ *
+ * Copyright (c) 2015 IBM (Alvin Wang, Li Yi)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/jiffies.h>
+#include <linux/i2c.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/delay.h>
+#include <asm/unaligned.h>
+
+#include "occ.h"
+#include "occ_sim.h"
+
+/* sample POLL response, served by the simulator by default */
+static const char fake_occ_rsp[OCC_DATA_MAX] = {
+0x69, 0x00, 0x00, 0x00, 0xa4, 0xc3, 0x00, 0x03, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+0x00, 0x00, 0x00, 0x00, 0x00, 0x6f, 0x70, 0x5f, 0x6f, 0x63, 0x63, 0x5f, 0x31, 0x35, 0x30, 0x37,
+0x31, 0x36, 0x61, 0x00, 0x00, 0x53, 0x45, 0x4e, 0x53, 0x4f, 0x52, 0x04, 0x01, 0x54, 0x45, 0x4d,    
+0x50, 0x00, 0x01, 0x04, 0x0a, 0x00 ,0x6a, 0x00, 0x00, 0x00, 0x6c, 0x00, 0x00, 0x00, 0x6d, 0x00,    
+0x00,0x00,0x6e,0x00, 0x00,0x00,0x6f,0x00, 0x00,0x00,0x70,0x00, 0x00,0x00,0x71,0x00,
+0x00,0x00,0x73,0x00, 0x00,0x00,0x74,0x00, 0x00,0x00,0x75,0x00, 0x00,0x46,0x52,0x45,    
+0x51,0x00,0x01,0x04, 0x0a,0x00,0x76,0x00, 0x00,0x00,0x78,0x00, 0x00,0x00,0x79,0x00,    
+0x00,0x00,0x7a,0x00, 0x00,0x00,0x7b,0x00, 0x00,0x00,0x7c,0x00, 0x00,0x00,0x7d,0x00,    
+0x00,0x00,0x7f,0x00, 0x00,0x00,0x80,0x00, 0x00,0x00,0x81,0x00, 0x00,0x50,0x4f,0x57,    
+0x52,0x00,0x01,0x0c, 0x00,0x43,0x41,0x50, 0x53,0x00,0x01,0x0c, 0x01,0x00,0x00,0x00,    
+0x00,0x04,0xb0,0x09, 0x60,0x04,0x4c,0x00, 0x00,0x17,0xc5,}; 
+
+/*
+ * Simulated P8 i2c slave and OCC SRAM, used instead of the bus when the
+ * module is loaded with simulate=1. It implements the getscom/putscom
+ * register protocol the driver speaks: a 4-byte write latches a SCOM
+ * address, an 8-byte read returns that register, a 12-byte write stores
+ * one. SCOM_OCC_SRAM_ADDR sets the SRAM pointer and every access through
+ * SCOM_OCC_SRAM_DATA moves it on by 8 bytes.
+ */
+static bool simulate;
+module_param(simulate, bool, S_IRUGO);
+MODULE_PARM_DESC(simulate, "Talk to a simulated OCC instead of the i2c bus");
+
+static int sim_temp = -1;
+module_param(sim_temp, int, S_IRUGO);
+MODULE_PARM_DESC(sim_temp, "TEMP sensors in the simulated response (-1: built-in sample)");
+
+static int sim_freq = -1;
+module_param(sim_freq, int, S_IRUGO);
+MODULE_PARM_DESC(sim_freq, "FREQ sensors in the simulated response (-1: built-in sample)");
+
+static int sim_powr = -1;
+module_param(sim_powr, int, S_IRUGO);
+MODULE_PARM_DESC(sim_powr, "POWR sensors in the simulated response (-1: built-in sample)");
+
+static unsigned int sim_xfer_delay_us;
+module_param(sim_xfer_delay_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(sim_xfer_delay_us, "Simulated latency of each bus transaction");
+
+static unsigned int sim_bus_khz;
+module_param(sim_bus_khz, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(sim_bus_khz, "Simulated bus clock, e.g. 100, 400, 1000 (0: no wire time)");
+
+static unsigned int sim_msg_overhead_us;
+module_param(sim_msg_overhead_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(sim_msg_overhead_us, "Simulated fixed cost of each i2c message");
+
+static unsigned int sim_update_ms;
+module_param(sim_update_ms, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(sim_update_ms, "Simulated OCC sensor refresh period (0: on every POLL)");
+
+static unsigned int sim_cmd_delay_us;
+module_param(sim_cmd_delay_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(sim_cmd_delay_us, "Simulated time for the OCC to answer a command");
+
+static unsigned int sim_fail_every;
+module_param(sim_fail_every, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(sim_fail_every, "Fail every Nth simulated bus transaction (0: never)");
+
+static unsigned int sim_corrupt_every;
+module_param(sim_corrupt_every, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(sim_corrupt_every, "Corrupt every Nth simulated POLL response (0: never)");
+
+#define OCC_SIM_SRAM_BASE	OCC_COMMAND_ADDR
+#define OCC_SIM_SRAM_SIZE	0x2000	/* command and response buffers */
+
+struct occ_sim {
+	uint32_t	scom_addr;	/* latched by the last address write */
+	uint32_t	sram_addr;	/* SCOM_OCC_SRAM_ADDR */
+	uint32_t	i2c_status;	/* I2C_STATUS_REG */
+	unsigned long	xfers;
+	unsigned long	polls;		/* POLL responses written */
+	unsigned long	updated;	/* jiffies of the last sensor refresh */
+	unsigned int	tick;		/* sensor refreshes so far */
+	int		chip;		/* bus number, added to every reading */
+	bool		cmd_pending;	/* doorbell rung, response not written yet */
+	u64		cmd_ready;	/* ktime_get_ns() when it will be */
+	uint8_t		sram[OCC_SIM_SRAM_SIZE];
+};
+
+static uint8_t *occ_sim_sram(struct occ_sim *sim, uint32_t addr)
+{
+	uint32_t off = addr - OCC_SIM_SRAM_BASE;
+
+	if (off > OCC_SIM_SRAM_SIZE - 8)
+		return NULL;
+
+	return &sim->sram[off];
+}
+
+/*
+ * num blocks of type, at most 255 sensors each, as long as they fit; each
+ * reading is chip higher than on chip 0, so OCCs can be told apart
+ */
+static int occ_sim_add_blocks(uint8_t *r, int len, const char *type, int rec_len,
+			      int num, int chip, unsigned int tick, int *num_blocks)
+{
+	int id = 1;
+	int n, i, v;
+	uint8_t *rec;
+
+	while (num > 0 && *num_blocks < OCC_MAX_BLOCKS) {
+		n = min(num, 255);
+		n = min(n, (OCC_DATA_MAX - OCC_RESP_CHKSUM_SIZE - len - 8) / rec_len);
+		if (n <= 0)
+			break;
+
+		memcpy(&r[len], type, 4);
+		r[len + 4] = 0;
+		r[len + 5] = 1;
+		r[len + 6] = rec_len;
+		r[len + 7] = n;
+		len = len + 8;
+
+		for (i = 0; i < n; i++, id++) {
+			rec = &r[len];
+			memset(rec, 0, rec_len);
+			rec[0] = id >> 8;
+			rec[1] = id;
+			if (rec_len == OCC_POWR_RECORD_SIZE) {
+				v = 100 + id % 100 + chip;
+				put_unaligned_be32(1 + tick, &rec[2]);	/* update_tag */
+				put_unaligned_be32(v * (1 + tick), &rec[6]);
+				rec[10] = v >> 8;
+				rec[11] = v;
+			} else {
+				v = (type[0] == 'T' ? 30 + id % 50 : 2000 + id) + chip;
+				rec[2] = v >> 8;
+				rec[3] = v;
+			}
+			len = len + rec_len;
+		}
+
+		num = num - n;
+		(*num_blocks)++;
+	}
+
+	return len;
+}
+
+/* build a POLL response into r, returns its length */
+/* one CAPS record, as in the sample: 1200 W norm, 2400 W max, 1100 W min */
+static int occ_sim_add_caps(uint8_t *r, int len, int *num_blocks)
+{
+	static const uint8_t caps[OCC_CAPS_RECORD_SIZE] = {
+		0, 0, 0, 0, 0x04, 0xb0, 0x09, 0x60, 0x04, 0x4c, 0, 0,
+	};
+
+	if (*num_blocks >= OCC_MAX_BLOCKS ||
+	    len + 8 + sizeof(caps) > OCC_DATA_MAX - OCC_RESP_CHKSUM_SIZE)
+		return len;
+
+	memcpy(&r[len], "CAPS", 4);
+	r[len + 4] = 0;
+	r[len + 5] = 1;
+	r[len + 6] = sizeof(caps);
+	r[len + 7] = 1;
+	memcpy(&r[len + 8], caps, sizeof(caps));
+	(*num_blocks)++;
+
+	return len + 8 + sizeof(caps);
+}
+
+/*
+ * POLL response data after the tick-th sensor refresh, update_tags and
+ * accumulators move with it; returns the length without the checksum
+ */
+static int occ_sim_build_response(uint8_t *r, int chip, unsigned int tick)
+{
+	int len = OCC_POLL_HDR_SIZE;
+	int num_blocks = 0;
+
+	if (sim_temp < 0 && sim_freq < 0 && sim_powr < 0) {
+		len = OCC_RESP_HDR_SIZE + ((uint8_t)fake_occ_rsp[3] << 8 |
+					   (uint8_t)fake_occ_rsp[4]);
+		memcpy(r, fake_occ_rsp, len);
+	} else {
+		memcpy(r, fake_occ_rsp, OCC_POLL_HDR_SIZE);
+		len = occ_sim_add_blocks(r, len, "TEMP", OCC_SENSOR_RECORD_SIZE,
+					 max(sim_temp, 0), chip, tick,
+					 &num_blocks);
+		len = occ_sim_add_blocks(r, len, "FREQ", OCC_SENSOR_RECORD_SIZE,
+					 max(sim_freq, 0), chip, tick,
+					 &num_blocks);
+		len = occ_sim_add_blocks(r, len, "POWR", OCC_POWR_RECORD_SIZE,
+					 max(sim_powr, 0), chip, tick,
+					 &num_blocks);
+		len = occ_sim_add_caps(r, len, &num_blocks);
+		r[43] = num_blocks;
+		r[3] = (len - OCC_RESP_HDR_SIZE) >> 8;
+		r[4] = len - OCC_RESP_HDR_SIZE;
+	}
+
+	return len;
+}
+
+/* the plain byte sum: the driver's word-at-a-time one is checked against it */
+static uint16_t occ_sim_checksum(const uint8_t *d, int len)
+{
+	uint16_t sum = 0;
+	int i;
+
+	for (i = 0; i < len; i++)
+		sum = sum + d[i];
+
+	return sum;
+}
+
+/* append the checksum of the len bytes at r */
+static void occ_sim_seal(uint8_t *r, int len)
+{
+	put_unaligned_be16(occ_sim_checksum(r, len), &r[len]);
+}
+
+static void occ_sim_init(struct occ_sim *sim)
+{
+	uint8_t *r = occ_sim_sram(sim, OCC_RESPONSE_ADDR);
+
+	sim->i2c_status = 0x80000000;
+	sim->updated = jiffies;
+	occ_sim_seal(r, occ_sim_build_response(r, sim->chip, 0));
+}
+
+/* doorbell: mark the response in progress, to be written sim_cmd_delay_us later */
+static void occ_sim_attn(struct occ_sim *sim)
+{
+	uint8_t *cmd = occ_sim_sram(sim, OCC_COMMAND_ADDR);
+	uint8_t *r = occ_sim_sram(sim, OCC_RESPONSE_ADDR);
+
+	r[0] = cmd[0];
+	r[1] = cmd[1];
+	r[2] = OCC_RESP_IN_PROGRESS;
+	sim->cmd_pending = true;
+	sim->cmd_ready = ktime_get_ns() + (u64)sim_cmd_delay_us * NSEC_PER_USEC;
+}
+
+/* answer the pending command once it is due */
+static void occ_sim_complete(struct occ_sim *sim)
+{
+	uint8_t *cmd = occ_sim_sram(sim, OCC_COMMAND_ADDR);
+	uint8_t *r = occ_sim_sram(sim, OCC_RESPONSE_ADDR);
+	int len = get_unaligned_be16(&cmd[2]);
+	uint8_t status = OCC_RESP_SUCCESS;
+	int n;
+
+	if (!sim->cmd_pending || ktime_get_ns() < sim->cmd_ready)
+		return;
+	sim->cmd_pending = false;
+
+	if (len > OCC_CMD_DATA_MAX ||
+	    occ_sim_checksum(cmd, OCC_CMD_HDR_SIZE + len) !=
+	    get_unaligned_be16(&cmd[OCC_CMD_HDR_SIZE + len]))
+		status = OCC_RESP_CHKSUM_FAIL;
+	else if (cmd[1] != OCC_CMD_POLL)
+		status = OCC_RESP_INVALID_CMD;
+
+	if (status == OCC_RESP_SUCCESS) {
+		/* new readings every sim_update_ms, or for every POLL */
+		if (!sim_update_ms ||
+		    time_after_eq(jiffies, sim->updated + msecs_to_jiffies(sim_update_ms))) {
+			sim->updated = jiffies;
+			sim->tick++;
+		}
+		n = occ_sim_build_response(r, sim->chip, sim->tick);
+	} else {
+		n = OCC_RESP_HDR_SIZE;
+		r[3] = 0;
+		r[4] = 0;
+	}
+
+	r[0] = cmd[0];
+	r[1] = cmd[1];
+	r[2] = status;
+	occ_sim_seal(r, n);
+
+	/* a bit flipped after the header: only the checksum tells */
+	if (status == OCC_RESP_SUCCESS && sim_corrupt_every &&
+	    ++sim->polls % sim_corrupt_every == 0)
+		r[n - 1] ^= 0x01;
+}
+
+/*
+ * one simulated bus transaction of msgs messages carrying bytes bytes:
+ * sim_xfer_delay_us, sim_msg_overhead_us per message, and at sim_bus_khz
+ * 9 clocks (8 bits + ACK) for every byte including each address byte
+ */
+static int occ_sim_xfer(struct occ_sim *sim, int msgs, int bytes)
+{
+	u64 ns = (u64)sim_xfer_delay_us * NSEC_PER_USEC +
+		 (u64)msgs * sim_msg_overhead_us * NSEC_PER_USEC;
+
+	sim->xfers++;
+
+	if (sim_bus_khz)
+		ns = ns + div_u64((u64)(bytes + msgs) * 9 * NSEC_PER_MSEC, sim_bus_khz);
+
+	if (ns >= 10 * NSEC_PER_USEC)
+		usleep_range(div_u64(ns, NSEC_PER_USEC), div_u64(ns + ns / 8, NSEC_PER_USEC));
+	else if (ns)
+		ndelay(ns);
+
+	if (sim_fail_every && sim->xfers % sim_fail_every == 0)
+		return -EIO;
+
+	return 0;
+}
+
+static int occ_sim_send(struct occ_sim *sim, const char *buf, int count)
+{
+	uint32_t data0;
+	uint8_t *sram;
+	int b;
+
+	if (count != 4 && count != 12)
+		return -EINVAL;
+
+	//P8 i2c slave takes the address shifted by 1
+	memcpy(&sim->scom_addr, &buf[0], sizeof(sim->scom_addr));
+	sim->scom_addr = sim->scom_addr >> 1;
+	if (count == 4)
+		return count;
+
+	memcpy(&data0, &buf[8], sizeof(data0));
+
+	switch (sim->scom_addr) {
+	case SCOM_OCC_SRAM_ADDR:
+		sim->sram_addr = data0;
+		if (data0 == OCC_RESPONSE_ADDR)
+			occ_sim_complete(sim);
+		break;
+	case SCOM_OCC_SRAM_DATA:
+		/* mirror of occ_getscomb(): bytes go in reversed */
+		sram = occ_sim_sram(sim, sim->sram_addr);
+		if (sram)
+			for (b = 0; b < 8; b++)
+				sram[b] = buf[11 - b];
+		sim->sram_addr = sim->sram_addr + 8;
+		break;
+	case SCOM_OCC_ATTN:
+		if (data0 == OCC_ATTN_DATA)
+			occ_sim_attn(sim);
+		break;
+	case I2C_STATUS_REG:
+	case I2C_ERROR_REG:
+		sim->i2c_status = 0x80000000;
+		break;
+	default:
+		break;
+	}
+
+	return count;
+}
+
+static int occ_sim_recv(struct occ_sim *sim, char *buf, int count)
+{
+	uint8_t *sram;
+	int b;
+
+	if (count != 8)
+		return -EINVAL;
+
+	memset(buf, 0, count);
+
+	switch (sim->scom_addr) {
+	case SCOM_OCC_SRAM_DATA:
+		sram = occ_sim_sram(sim, sim->sram_addr);
+		if (sram)
+			for (b = 0; b < 8; b++)
+				buf[7 - b] = sram[b];
+		sim->sram_addr = sim->sram_addr + 8;
+		break;
+	case I2C_STATUS_REG:
+		memcpy(&buf[4], &sim->i2c_status, sizeof(sim->i2c_status));
+		break;
+	default:
+		break;
+	}
+
+	return count;
+}
+
+static int occ_sim_msgs(struct occ_sim *sim, struct i2c_msg *msgs, int num)
+{
+	int ret = 0;
+	int i;
+
+	for (i = 0; i < num; i++) {
+		if (msgs[i].flags & I2C_M_RD)
+			ret = occ_sim_recv(sim, (char *)msgs[i].buf, msgs[i].len);
+		else
+			ret = occ_sim_send(sim, (const char *)msgs[i].buf, msgs[i].len);
+		if (ret < 0)
+			return ret;
+	}
+
+	return num;
+}
+
+/* an 8-byte read of the latched SCOM register */
+int occ_sim_read(struct occ_sim *sim, char *buf, int count)
+{
+	return occ_sim_xfer(sim, 1, count) ?: occ_sim_recv(sim, buf, count);
+}
+
+/* a SCOM address, or an address and the 8 bytes to store there */
+int occ_sim_write(struct occ_sim *sim, const char *buf, int count)
+{
+	return occ_sim_xfer(sim, 1, count) ?: occ_sim_send(sim, buf, count);
+}
+
+/* returns num on success, like i2c_transfer() */
+int occ_sim_transfer(struct occ_sim *sim, struct i2c_msg *msgs, int num)
+{
+	int bytes = 0;
+	int i;
+
+	for (i = 0; i < num; i++)
+		bytes = bytes + msgs[i].len;
+
+	return occ_sim_xfer(sim, num, bytes) ?: occ_sim_msgs(sim, msgs, num);
+}
+
+struct occ_sim *occ_sim_create(struct device *dev)
+{
+	struct occ_sim *sim;
+
+	if (!simulate)
+		return NULL;
+
+	sim = devm_kzalloc(dev, sizeof(*sim), GFP_KERNEL);
+	if (!sim)
+		return ERR_PTR(-ENOMEM);
+	/* one OCC per bus: the bus number tells them apart */
+	sim->chip = to_i2c_client(dev)->adapter->nr;
+	occ_sim_init(sim);
+
+	return sim;
+}
@@ -0,0 +1,56 @@
+/*
+ * BMC OCC HWMON driver - simulated OCC, for testing without the hardware.
+ *
+ * Copyright (c) 2015 IBM (Alvin Wang, Li Yi)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __OCC_SIM_H__
+#define __OCC_SIM_H__
+
+#include <linux/err.h>
+#include <linux/i2c.h>
+
+struct occ_sim;
+
+#ifdef CONFIG_SENSORS_P8_OCC_SIM
+/*
+ * NULL unless the module was loaded with simulate=1. The others stand in
+ * for i2c_master_recv(), i2c_master_send() and i2c_transfer().
+ */
+struct occ_sim *occ_sim_create(struct device *dev);
+int occ_sim_read(struct occ_sim *sim, char *buf, int count);
+int occ_sim_write(struct occ_sim *sim, const char *buf, int count);
+int occ_sim_transfer(struct occ_sim *sim, struct i2c_msg *msgs, int num);
+#else
+static inline struct occ_sim *occ_sim_create(struct device *dev)
+{
+	return NULL;
+}
+
+static inline int occ_sim_read(struct occ_sim *sim, char *buf, int count)
+{
+	return -ENODEV;
+}
+
+static inline int occ_sim_write(struct occ_sim *sim, const char *buf, int count)
+{
+	return -ENODEV;
+}
+
+static inline int occ_sim_transfer(struct occ_sim *sim, struct i2c_msg *msgs, int num)
+{
+	return -ENODEV;
+}
+#endif
+
+#endif /* __OCC_SIM_H__ */
@@ -0,0 +1,188 @@
+/*
+ * Benchmarks for the OCC driver, see occ_test.h. One JSON object per
+ * line:
+ *
+ *	occ_bench [overhead_us]	parser, poll latency, then sample rate;
+ *				overhead_us is the per-message cost of the
+ *				simulated bus (default 0)
+ */
+
+#include "occ_test.h"
+
+static int occ_cmp_u64(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a;
+	u64 y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* p-th percentile of n sorted values */
+static u64 occ_pct(const u64 *v, int n, int p)
+{
+	return n ? v[(n - 1) * p / 100] : 0;
+}
+
+/*
+ * Whole polls, start to publishable snapshot, against the simulated bus
+ * at 100 kHz, 400 kHz and 1 MHz, with new readings on every poll.
+ */
+static void bench_poll(unsigned int overhead_us)
+{
+	static const unsigned int khz[] = { 100, 400, 1000 };
+	enum { POLLS = 200 };
+	static u64 us[POLLS];
+	struct occ_test_dev t;
+	struct occ_drv_data *data;
+	u64 t0;
+	int k, i;
+
+	for (k = 0; k < ARRAY_SIZE(khz); k++) {
+		occ_test_sim_defaults();
+		occ_test_sim_sensors(24, 12, 8);
+		occ_test_param("sim_bus_khz", khz[k]);
+		occ_test_param("sim_msg_overhead_us", overhead_us);
+		data = occ_test_probe(&t, 0);
+
+		for (i = 0; i < POLLS; i++) {
+			t0 = ktime_get_ns();
+			occ_test_poll(data);
+			us[i] = (ktime_get_ns() - t0) / NSEC_PER_USEC;
+		}
+		qsort(us, POLLS, sizeof(us[0]), occ_cmp_u64);
+
+		printf("{\"bench\": \"poll\", \"bus_khz\": %u, \"msg_overhead_us\": %u, "
+		       "\"polls\": %d, \"errors\": %lu, \"xfers_per_poll\": %u, "
+		       "\"msgs_per_poll\": %u, \"bytes_per_poll\": %u, \"resp_bytes\": %u, "
+		       "\"us_p50\": %llu, \"us_p90\": %llu, \"us_p99\": %llu, \"us_max\": %llu}\n",
+		       khz[k], overhead_us, POLLS, data->stats.poll_errors,
+		       data->stats.last_xfers, data->stats.last_msgs, data->stats.last_bytes,
+		       data->stats.last_resp_bytes, occ_pct(us, POLLS, 50),
+		       occ_pct(us, POLLS, 90), occ_pct(us, POLLS, 99), us[POLLS - 1]);
+		occ_test_remove(&t);
+	}
+}
+
+/*
+ * parse_occ_response() alone, on responses the simulator generates: cost
+ * per response and per sensor, and what it allocates (nothing, it parses
+ * into the arena).
+ */
+static void bench_parse(void)
+{
+	static const struct {
+		const char	*mix;
+		int		temp, freq, powr;	/* shares of the sensors */
+	} mixes[] = {
+		{ "temp", 1, 0, 0 },
+		{ "temp_freq", 1, 1, 0 },
+		{ "mixed", 1, 1, 1 },
+		{ "powr", 0, 0, 1 },
+	};
+	static const int counts[] = { 10, 100, 1000 };
+	static uint8_t raw[OCC_DATA_MAX];
+	struct occ_test_dev t;
+	struct occ_drv_data *data;
+	occ_response_t *o;
+	struct occ_arena *a;
+	unsigned long allocs, bytes;
+	int m, c, n, len, iters, shares, sensors;
+	u64 t0, ns;
+
+	for (m = 0; m < ARRAY_SIZE(mixes); m++) {
+		for (c = 0; c < ARRAY_SIZE(counts); c++) {
+			n = counts[c];
+			shares = mixes[m].temp + mixes[m].freq + mixes[m].powr;
+			occ_test_sim_defaults();
+			occ_test_sim_sensors(n * mixes[m].temp / shares,
+					     n * mixes[m].freq / shares,
+					     n * mixes[m].powr / shares);
+			data = occ_test_probe(&t, 0);
+			occ_test_poll(data);
+			len = data->raw_len;
+			memcpy(raw, data->occ_raw, len);
+
+			o = data->occ_buf[data->occ_next];
+			a = data->occ_arena[data->occ_next];
+			allocs = kshim_allocs;
+			bytes = kshim_alloc_bytes;
+			iters = 0;
+			t0 = ktime_get_ns();
+			do {
+				deinit_occ_resp_buf(o);
+				if (parse_occ_response(raw, len, o, a))
+					break;
+				iters++;
+			} while (ktime_get_ns() - t0 < 200 * NSEC_PER_MSEC);
+			ns = ktime_get_ns() - t0;
+
+			sensors = o->temp->num + o->freq->num + o->powr->num + o->caps->num;
+			printf("{\"bench\": \"parse\", \"mix\": \"%s\", \"sensors_requested\": %d, "
+			       "\"sensors\": %d, \"blocks\": %d, \"response_bytes\": %d, "
+			       "\"iterations\": %d, \"ns_per_response\": %llu, "
+			       "\"ns_per_sensor\": %llu, \"allocs_per_parse\": %.2f, "
+			       "\"bytes_allocated_per_parse\": %.2f}\n",
+			       mixes[m].mix, n, sensors, o->data.num_of_sensor_blocks, len,
+			       iters, iters ? ns / iters : 0,
+			       iters && sensors ? ns / iters / sensors : 0,
+			       iters ? (double)(kshim_allocs - allocs) / iters : 0,
+			       iters ? (double)(kshim_alloc_bytes - bytes) / iters : 0);
+			occ_test_remove(&t);
+		}
+	}
+}
+
+/*
+ * Samples/sec with the poller on its own schedule, each poll a fixed
+ * update_interval after the last one started, against a 400 kHz bus and
+ * an OCC that takes 2 ms to answer a POLL. At 10 ms a poll takes longer
+ * than the interval, so they run back to back.
+ */
+static void bench_rate(unsigned int overhead_us)
+{
+	static const unsigned int interval_ms[] = { OCC_UPDATE_INTERVAL_MIN, 50, 250 };
+	struct occ_test_dev t;
+	struct occ_drv_data *data;
+	unsigned long samples, delay;
+	u64 t0, ns;
+	int k;
+
+	for (k = 0; k < ARRAY_SIZE(interval_ms); k++) {
+		occ_test_sim_defaults();
+		occ_test_sim_sensors(24, 12, 8);
+		occ_test_param("sim_bus_khz", 400);
+		occ_test_param("sim_msg_overhead_us", overhead_us);
+		occ_test_param("sim_cmd_delay_us", 2000);
+		data = occ_test_probe(&t, 0);
+		occ_set_update_interval(data, interval_ms[k]);
+
+		samples = data->stats.poll_us_count;
+		t0 = ktime_get_ns();
+		do {
+			occ_test_poll(data);
+			if (kshim_work_pending(&data->poll_work, &delay) && delay)
+				msleep(jiffies_to_msecs(delay));
+		} while (ktime_get_ns() - t0 < 2 * NSEC_PER_SEC);
+		ns = ktime_get_ns() - t0;
+		samples = data->stats.poll_us_count - samples;
+
+		printf("{\"bench\": \"rate\", \"update_interval_ms\": %u, \"bus_khz\": 400, "
+		       "\"msg_overhead_us\": %u, \"cmd_delay_us\": 2000, \"samples\": %lu, "
+		       "\"samples_per_sec\": %llu, \"poll_errors\": %lu, "
+		       "\"sample_age_us\": %u}\n",
+		       interval_ms[k], overhead_us, samples, samples * NSEC_PER_SEC / ns,
+		       data->stats.poll_errors, data->stats.sample_age_us);
+		occ_test_remove(&t);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int overhead_us = argc > 1 ? strtoul(argv[1], NULL, 0) : 0;
+
+	bench_parse();
+	bench_poll(overhead_us);
+	bench_rate(overhead_us);
+
+	return 0;
+}
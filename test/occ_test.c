@@ -0,0 +1,1080 @@
+/*
+ * Functional tests for the OCC driver, see occ_test.h. The benchmarks
+ * are in occ_bench.c.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "occ_test.h"
+
+static int failures;
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: %s: CHECK(%s) failed\n",	\
+				__FILE__, __LINE__, __func__, #cond);	\
+			failures++;					\
+		}							\
+	} while (0)
+
+static u16 occ_test_byte_sum(const uint8_t *d, int len)
+{
+	u16 sum = 0;
+	int i;
+
+	for (i = 0; i < len; i++)
+		sum = sum + d[i];
+
+	return sum;
+}
+
+/* ----------------------------------------------------------------------*/
+/* functional tests */
+
+static void test_checksum(void)
+{
+	static uint8_t buf[OCC_DATA_MAX + 7];
+	int len, off, i;
+
+	srand(1);
+	for (i = 0; i < (int)sizeof(buf); i++)
+		buf[i] = rand();
+	/* all 0xff is where the lanes come closest to overflowing */
+	memset(buf + 7, 0xff, OCC_DATA_MAX / 2);
+
+	for (off = 0; off < 8; off++)
+		for (len = 0; len <= OCC_DATA_MAX; len = len < 64 ? len + 1 : len + 61)
+			CHECK(occ_checksum(buf + off, len) ==
+			      occ_test_byte_sum(buf + off, len));
+}
+
+/* the built-in sample: 10 TEMP, 10 FREQ, an empty POWR block, 1 CAPS */
+static void test_sample_response(void)
+{
+	struct occ_test_dev t;
+	struct occ_drv_data *data;
+	struct device *hwmon_dev;
+	occ_response_t *resp;
+
+	occ_test_sim_defaults();
+	data = occ_test_probe(&t, 0);
+
+	/* probe polled once and registered the sensors it found */
+	resp = occ_test_resp(data);
+	CHECK(resp != NULL);
+	CHECK(data->stats.polls == 1 && data->stats.poll_errors == 0);
+	CHECK(occ_test_due_in(data, data->sample_time));
+	if (!resp)
+		goto out;
+
+	CHECK(resp->temp->num == 10);
+	CHECK(resp->freq->num == 10);
+	CHECK(resp->powr->num == 0);
+	CHECK(resp->caps->num == 1);
+	CHECK(resp->temp->ids[0] == 0x6a && resp->freq->ids[9] == 0x81);
+	CHECK(resp->caps->norm_powercap[0] == 1200);
+	CHECK(resp->caps->max_powercap[0] == 2400);
+	CHECK(resp->caps->min_powercap[0] == 1100);
+
+	CHECK(occ_test_channels(data->hwmon_dev, hwmon_temp) == 10);
+	CHECK(occ_test_channels(data->hwmon_dev, hwmon_power) == 0);
+	CHECK(occ_test_read(data, hwmon_temp, hwmon_temp_input, 0) == 0);
+	CHECK(occ_test_read(data, hwmon_chip, hwmon_chip_update_interval, 0) == 1000);
+	CHECK(data->freq_group.attrs && data->freq_group.attrs[19] &&
+	      !data->freq_group.attrs[20]);
+
+	/* polls keep the device; channels whose sensor changed read nothing */
+	hwmon_dev = data->hwmon_dev;
+	occ_test_sim_sensors(12, 0, 0);
+	occ_test_poll(data);
+	CHECK(data->hwmon_dev == hwmon_dev && data->stats.poll_errors == 0);
+	CHECK(occ_test_resp(data)->temp->num == 12 && occ_test_resp(data)->temp->ids[0] == 1);
+	CHECK(occ_test_channels(data->hwmon_dev, hwmon_temp) == 10);
+	CHECK(occ_test_read(data, hwmon_temp, hwmon_temp_input, 0) == -1);
+	occ_test_sim_sensors(-1, -1, -1);
+	occ_test_poll(data);
+	CHECK(occ_test_read(data, hwmon_temp, hwmon_temp_input, 0) == 0);
+out:
+	occ_test_remove(&t);
+}
+
+/* generated responses, checked against what occ_sim.c puts in them */
+static void test_generated_response(void)
+{
+	struct occ_test_dev t;
+	struct occ_drv_data *data;
+	occ_response_t *resp;
+	const char *label;
+	int i, id, bad = 0;
+
+	occ_test_sim_defaults();
+	occ_test_sim_sensors(300, 20, 40);
+	/* probe polls first */
+	data = occ_test_probe(&t, 0);
+	occ_test_poll(data);
+	occ_test_poll(data);
+
+	resp = occ_test_resp(data);
+	CHECK(resp != NULL);
+	if (!resp)
+		goto out;
+
+	/* 255 sensors per block at most: TEMP takes two */
+	CHECK(resp->data.num_of_sensor_blocks == 5);
+	CHECK(resp->temp->num == 300);
+	CHECK(resp->freq->num == 20);
+	CHECK(resp->powr->num == 40);
+
+	for (i = 0; i < resp->temp->num; i++) {
+		id = i + 1;
+		bad += resp->temp->ids[i] != id || resp->temp->values[i] != 30 + id % 50;
+	}
+	for (i = 0; i < resp->freq->num; i++) {
+		id = i + 1;
+		bad += resp->freq->ids[i] != id || resp->freq->values[i] != 2000 + id;
+	}
+	/* the simulator refreshes once per POLL, from update_tag 1 */
+	for (i = 0; i < resp->powr->num; i++) {
+		id = i + 1;
+		bad += resp->powr->values[i] != 100 + id % 100 ||
+		       resp->powr->update_tags[i] != 4 ||
+		       resp->powr->accumulators[i] != 4 * resp->powr->values[i];
+	}
+	CHECK(bad == 0);
+	/* each arena of the double buffer keeps its layout from its first parse */
+	CHECK(data->stats.parses == 3 && data->stats.parses_values_only == 1);
+
+	CHECK(occ_test_read(data, hwmon_temp, hwmon_temp_input, 299) == (30 + 300 % 50) * 1000);
+	CHECK(occ_test_read(data, hwmon_power, hwmon_power_input, 0) == 101 * 1000000L);
+	CHECK(occ_test_read(data, hwmon_power, hwmon_power_average, 0) == 101 * 1000000L);
+	CHECK(!data->hwmon_dev->chip->ops->read_string(data->hwmon_dev, hwmon_temp,
+						       hwmon_temp_label, 0, &label) &&
+	      !strcmp(label, "sensor id: 1"));
+out:
+	occ_test_remove(&t);
+}
+
+/*
+ * parse_occ_response() on a copy of len bytes of resp, in a buffer of
+ * exactly that size: under -fsanitize=address any read past it faults.
+ */
+static int occ_test_parse(const uint8_t *resp, int len, occ_response_t *o,
+			  struct occ_arena *a)
+{
+	uint8_t *d = malloc(len);
+	int ret;
+
+	memcpy(d, resp, len);
+	deinit_occ_resp_buf(o);
+	ret = parse_occ_response(d, len, o, a);
+	free(d);
+
+	return ret;
+}
+
+/*
+ * Responses whose header or block heads lie about their size are rejected
+ * before anything outside them is read. Layout of the 4 TEMP, 2 POWR
+ * response below: poll header, TEMP head at 45, its records at 53, POWR
+ * head at 69, its records at 77, CAPS head at 101.
+ */
+static void test_malformed(void)
+{
+	static uint8_t raw[2 * OCC_DATA_MAX], d[2 * OCC_DATA_MAX];
+	struct occ_test_dev t;
+	struct occ_drv_data *data;
+	occ_response_t *o;
+	struct occ_arena *a;
+	int len, n, i, b, ok;
+
+	occ_test_sim_defaults();
+	occ_test_sim_sensors(4, 0, 2);
+	data = occ_test_probe(&t, 0);
+	len = data->raw_len;
+	memcpy(raw, data->occ_raw, len);
+	o = data->occ_buf[data->occ_next];
+	a = data->occ_arena[data->occ_next];
+
+	CHECK(!memcmp(&raw[45], "TEMP", 4) && !memcmp(&raw[69], "POWR", 4) &&
+	      !memcmp(&raw[101], "CAPS", 4));
+	CHECK(occ_test_parse(raw, len, o, a) == 0 && o->temp->num == 4);
+
+	/* data_length short of the poll data: sensor data would end before it starts */
+	for (n = 0; n < OCC_POLL_HDR_SIZE - OCC_RESP_HDR_SIZE; n++) {
+		memcpy(d, raw, len);
+		put_unaligned_be16(n, &d[3]);
+		CHECK(occ_test_parse(d, len, o, a) == -EBADMSG);
+	}
+	/* room for the poll data but not the first block head */
+	memcpy(d, raw, len);
+	put_unaligned_be16(OCC_POLL_HDR_SIZE - OCC_RESP_HDR_SIZE + 7, &d[3]);
+	CHECK(occ_test_parse(d, len, o, a) == -EBADMSG);
+	/* and longer than what was read */
+	memcpy(d, raw, len);
+	put_unaligned_be16(len, &d[3]);
+	CHECK(occ_test_parse(d, len, o, a) == -EBADMSG);
+
+	/* records past the end of the response */
+	memcpy(d, raw, len);
+	d[45 + 7] = 200;
+	CHECK(occ_test_parse(d, len, o, a) == -EBADMSG);
+	memcpy(d, raw, len);
+	d[45 + 6] = 255;
+	d[45 + 7] = 255;
+	CHECK(occ_test_parse(d, len, o, a) == -EBADMSG);
+	/* a block count with no heads behind it */
+	memcpy(d, raw, len);
+	d[43] = 4;
+	CHECK(occ_test_parse(d, len, o, a) == -EBADMSG);
+
+	/* sensor_length below the record size: a POWR read would overrun */
+	memcpy(d, raw, len);
+	d[69 + 6] = OCC_SENSOR_RECORD_SIZE;
+	CHECK(occ_test_parse(d, len, o, a) == -EBADMSG);
+
+	/*
+	 * More TEMP sensors than the table holds. A response read from the
+	 * OCC is too short for that, so this one is longer than OCC_DATA_MAX.
+	 */
+	memcpy(d, raw, OCC_POLL_HDR_SIZE);
+	n = OCC_POLL_HDR_SIZE;
+	for (b = 0; b < 5; b++) {
+		memcpy(&d[n], "TEMP", 4);
+		d[n + 4] = 0;
+		d[n + 5] = 1;
+		d[n + 6] = OCC_SENSOR_RECORD_SIZE;
+		d[n + 7] = 255;
+		n = n + 8;
+		for (i = 0; i < 255; i++, n += OCC_SENSOR_RECORD_SIZE)
+			put_unaligned_be32((b * 255 + i + 1) << 16 | 40, &d[n]);
+	}
+	d[43] = 5;
+	put_unaligned_be16(n - OCC_RESP_HDR_SIZE, &d[3]);
+	n = n + OCC_RESP_CHKSUM_SIZE;
+	CHECK(5 * 255 > OCC_MAX_SENSORS);
+	CHECK(occ_test_parse(d, n, o, a) == -EINVAL);
+	/* four of them fit */
+	d[43] = 4;
+	put_unaligned_be16(OCC_POLL_HDR_SIZE - OCC_RESP_HDR_SIZE + 4 * (8 + 255 * 4), &d[3]);
+	CHECK(occ_test_parse(d, n, o, a) == 0 && o->temp->num == 4 * 255);
+
+	/* random damage: whatever the parser makes of it, it stays inside */
+	srand(17);
+	for (i = 0, ok = 0; i < 200000; i++) {
+		memcpy(d, raw, len);
+		for (b = rand() % 4; b >= 0; b--)
+			d[rand() % len] = rand();
+		n = rand() % 8 ? len : OCC_POLL_HDR_SIZE + rand() % (len - OCC_POLL_HDR_SIZE);
+		if (!occ_test_parse(d, n, o, a)) {
+			ok++;
+			CHECK(o->temp->num <= OCC_MAX_SENSORS && o->powr->num <= OCC_MAX_POWR_SENSORS &&
+			      o->caps->num <= OCC_MAX_CAPS_SENSORS);
+			occ_build_snapshot(o, a, 1, 0);
+			CHECK(o->image_len <= OCC_SNAPSHOT_MAX);
+		}
+	}
+	CHECK(ok > 0);
+
+	occ_test_remove(&t);
+}
+
+/* an OCC that has nothing new is not parsed again, and polled less */
+static void test_unchanged(void)
+{
+	struct occ_test_dev t;
+	struct occ_drv_data *data;
+	unsigned long checked;
+
+	/* POWR present: the update_tag probe skips the rest of the read */
+	occ_test_sim_defaults();
+	occ_test_sim_sensors(4, 4, 4);
+	occ_test_param("sim_update_ms", 60000);
+	data = occ_test_probe(&t, 0);
+
+	checked = occ_test_resp(data)->checked;
+	CHECK(occ_test_due_in(data, data->sample_time));
+	msleep(2);
+
+	occ_test_poll(data);
+	occ_test_poll(data);
+	CHECK(data->stats.polls_unchanged == 2);
+	CHECK(data->stats.polls_unchanged_tag == 2);
+	CHECK(data->stats.parses == 1);
+	CHECK(data->stats.last_resp_bytes < data->pub_len);
+	CHECK(data->backoff == 4);
+	CHECK(occ_test_due_in(data, 4 * data->sample_time));
+	/* still current: age_ms counts from the last POLL that said so */
+	CHECK(time_after(occ_test_resp(data)->checked, checked));
+	occ_test_remove(&t);
+
+	/* no POWR: caught by comparing the bytes, still not parsed */
+	occ_test_sim_defaults();
+	occ_test_sim_sensors(4, 4, 0);
+	occ_test_param("sim_update_ms", 60000);
+	data = occ_test_probe(&t, 0);
+	occ_test_poll(data);
+	CHECK(data->stats.polls_unchanged == 1);
+	CHECK(data->stats.polls_unchanged_tag == 0);
+	CHECK(data->stats.parses == 1);
+	CHECK(data->backoff == 2);
+
+	/* something new: parsed, back to the normal interval */
+	occ_test_param("sim_temp", 5);
+	occ_test_poll(data);
+	CHECK(data->stats.parses == 2 && data->backoff == 1);
+	occ_test_remove(&t);
+}
+
+/* polls start a fixed period apart, and none start while suspended */
+static void test_schedule(void)
+{
+	const struct dev_pm_ops *pm = occ_driver.driver.pm;
+	struct occ_test_dev t;
+	struct occ_drv_data *data;
+	unsigned long delay;
+
+	occ_test_sim_defaults();
+	occ_test_sim_sensors(4, 4, 4);
+	occ_test_param("sim_cmd_delay_us", 20000);
+	data = occ_test_probe(&t, 0);
+
+	/* the 20 ms the OCC took to answer come off the wait for the next */
+	occ_test_poll(data);
+	CHECK(kshim_work_pending(&data->poll_work, &delay) &&
+	      delay + msecs_to_jiffies(20) <= data->sample_time);
+
+	CHECK(pm && !pm->suspend(&t.client.dev));
+	CHECK(!kshim_work_pending(&data->poll_work, NULL));
+	/* readers finding a poll due and interval changes leave it off */
+	revalidate = true;
+	data->poll_started = jiffies - 2 * data->sample_time;
+	CHECK(occ_test_read(data, hwmon_temp, hwmon_temp_input, 0) == 31000);
+	occ_set_update_interval(data, 100);
+	CHECK(!kshim_work_pending(&data->poll_work, NULL));
+
+	/* back: the data is from before the suspend, poll now */
+	CHECK(!pm->resume(&t.client.dev));
+	CHECK(kshim_work_pending(&data->poll_work, &delay) && delay == 0);
+	revalidate = false;
+	occ_test_remove(&t);
+}
+
+/* bus errors fail the poll, keep what was published, and pass */
+static void test_bus_errors(void)
+{
+	struct occ_test_dev t;
+	struct occ_drv_data *data;
+	occ_response_t *resp;
+	int i;
+
+	occ_test_sim_defaults();
+	occ_test_sim_sensors(8, 8, 8);
+	data = occ_test_probe(&t, 0);
+	resp = occ_test_resp(data);
+	CHECK(resp != NULL);
+
+	occ_test_param("sim_fail_every", 5);
+	for (i = 0; i < 20; i++)
+		occ_test_poll(data);
+	CHECK(data->stats.poll_errors > 0);
+	resp = occ_test_resp(data);
+	CHECK(resp && resp->temp->num == 8 && resp->powr->num == 8);
+
+	occ_test_param("sim_fail_every", 0);
+	i = data->stats.poll_errors;
+	occ_test_poll(data);
+	occ_test_poll(data);
+	CHECK(data->stats.poll_errors == i);
+	CHECK(data->stats.checksum_errors == 0);
+	occ_test_remove(&t);
+}
+
+/* a response that fails its checksum is dropped; readers keep the last */
+static void test_corrupt(void)
+{
+	struct occ_test_dev t;
+	struct occ_drv_data *data;
+	occ_response_t *resp;
+	struct occ_snapshot_hdr h;
+	unsigned long errors;
+
+	occ_test_sim_defaults();
+	occ_test_sim_sensors(4, 4, 4);
+	data = occ_test_probe(&t, 0);
+	resp = occ_test_resp(data);
+	CHECK(resp && resp->powr->update_tags[0] == 2 && data->snap_seq == 1);
+	errors = data->stats.poll_errors;
+
+	occ_test_param("sim_corrupt_every", 1);
+	occ_test_poll(data);
+	occ_test_poll(data);
+	CHECK(data->stats.checksum_errors == 2 && data->stats.poll_errors == errors + 2);
+	CHECK(occ_test_resp(data) == resp && data->snap_seq == 1);
+	CHECK(resp->powr->update_tags[0] == 2);
+	memcpy(&h, resp->image, sizeof(h));
+	CHECK(h.seq == 1 && data->ring->hdr->head == 1);
+	CHECK(occ_test_read(data, hwmon_temp, hwmon_temp_input, 0) == 31000);
+
+	/* the next good one is published */
+	occ_test_param("sim_corrupt_every", 0);
+	occ_test_poll(data);
+	resp = occ_test_resp(data);
+	CHECK(data->stats.checksum_errors == 2 && data->stats.poll_errors == errors + 2);
+	CHECK(resp->powr->update_tags[0] == 5 && data->snap_seq == 2);
+	occ_test_remove(&t);
+}
+
+/*
+ * Bus errors while the update_tag is looked at: the rest of the response
+ * is still read from right after the header, or the poll fails. It never
+ * reads from wherever the tag left the SRAM address.
+ */
+static void test_tag_bus_errors(void)
+{
+	struct occ_test_dev t;
+	struct occ_drv_data *data;
+	unsigned long xfers, errors, unchanged;
+	unsigned int k, n;
+
+	occ_test_sim_defaults();
+	occ_test_sim_sensors(8, 8, 8);
+	/* the readings never change: every poll looks at the tag */
+	occ_test_param("sim_update_ms", 1000000);
+	data = occ_test_probe(&t, 0);
+	/* the transactions so far: probe's i2c status check, then a poll */
+	xfers = data->stats.last_xfers;
+	data->stats.xfers = 0;
+	occ_check_i2c_errors(&t.client);
+	xfers += 2 * data->stats.xfers;
+	occ_test_poll(data);
+	xfers += data->stats.last_xfers;
+	CHECK(data->stats.polls_unchanged_tag == 1);
+
+	/* fail the k-th bus transaction of such a poll, for every k */
+	n = data->stats.last_xfers;
+	errors = data->stats.poll_errors;
+	for (k = 1; k <= n; k++) {
+		occ_test_param("sim_fail_every", xfers + k);
+		occ_test_poll(data);
+		xfers += data->stats.last_xfers;
+	}
+	/* failing the tag read costs the full read, not the poll */
+	unchanged = data->stats.polls_unchanged - data->stats.polls_unchanged_tag;
+	CHECK(unchanged > 0 && data->stats.poll_errors - errors + unchanged == n);
+	CHECK(data->stats.checksum_errors == 0);
+
+	occ_test_param("sim_fail_every", 0);
+	errors = data->stats.poll_errors;
+	occ_test_poll(data);
+	CHECK(data->stats.poll_errors == errors);
+	CHECK(occ_test_resp(data)->temp->num == 8 && occ_test_resp(data)->powr->num == 8);
+	occ_test_remove(&t);
+}
+
+/* the snapshot file: header, tables, trailing seq */
+static void test_snapshot(void)
+{
+	static char buf[OCC_SNAPSHOT_MAX];
+	struct occ_test_dev t;
+	struct occ_drv_data *data;
+	struct occ_snapshot_hdr h;
+	occ_response_t *resp;
+	uint32_t seq;
+	uint16_t v;
+	ssize_t n;
+
+	occ_test_sim_defaults();
+	occ_test_sim_sensors(3, 2, 1);
+	/* probe polls first */
+	data = occ_test_probe(&t, 0);
+	occ_test_poll(data);
+	n = bin_attr_snapshot.read(NULL, &data->hwmon_dev->kobj, &bin_attr_snapshot,
+				   buf, 0, sizeof(buf));
+	memcpy(&h, buf, sizeof(h));
+	CHECK(n > (ssize_t)sizeof(h) && n == h.size);
+	CHECK(h.magic == OCC_SNAPSHOT_MAGIC && h.version == OCC_SNAPSHOT_VERSION);
+	CHECK(h.hdr_size == sizeof(h));
+	CHECK(h.seq == 2 && h.seq == data->snap_seq);
+	CHECK(h.num_temp == 3 && h.num_freq == 2 && h.num_powr == 1 && h.num_caps == 1);
+	memcpy(&seq, buf + n - sizeof(seq), sizeof(seq));
+	CHECK(seq == h.seq);
+
+	/* the POLL was sent before the data was read: never in the future */
+	resp = occ_test_resp(data);
+	CHECK(h.timestamp == data->resp_sent_ns && h.timestamp <= ktime_get_ns());
+	CHECK(resp->checked == data->resp_sent);
+
+	/* second FREQ value, after the TEMP ids and values and the FREQ ids */
+	memcpy(&v, buf + sizeof(h) + (2 * 3 + 2 + 1) * sizeof(uint16_t), sizeof(v));
+	CHECK(v == 2002);
+
+	/* responses as full as they get, with the smallest and largest records */
+	occ_test_sim_sensors(1000, 0, 0);
+	occ_test_poll(data);
+	CHECK(data->raw_len > OCC_DATA_MAX - 32 && occ_test_resp(data)->temp->num == 1000);
+	CHECK(occ_test_resp(data)->image_len <= OCC_SNAPSHOT_MAX);
+	occ_test_sim_sensors(0, 0, 1000);
+	occ_test_poll(data);
+	CHECK(data->raw_len > OCC_DATA_MAX - 32 && occ_test_resp(data)->powr->num > 300);
+	CHECK(occ_test_resp(data)->image_len <= OCC_SNAPSHOT_MAX);
+	occ_test_remove(&t);
+}
+
+/* ----------------------------------------------------------------------*/
+/* concurrency */
+
+/*
+ * Mismatches between resp and what the simulated OCC on bus chip sends:
+ * its own readings, all POWR sensors from the same refresh.
+ */
+static int occ_test_resp_bad(occ_response_t *resp, int chip)
+{
+	uint32_t tag;
+	int i, id, bad = 0;
+
+	if (!resp)
+		return 1;
+
+	for (i = 0; i < resp->temp->num; i++) {
+		id = i + 1;
+		bad += resp->temp->values[i] != 30 + id % 50 + chip;
+	}
+	for (i = 0; i < resp->freq->num; i++) {
+		id = i + 1;
+		bad += resp->freq->values[i] != 2000 + id + chip;
+	}
+	tag = resp->powr->num ? resp->powr->update_tags[0] : 0;
+	for (i = 0; i < resp->powr->num; i++) {
+		id = i + 1;
+		bad += resp->powr->values[i] != 100 + id % 100 + chip ||
+		       resp->powr->update_tags[i] != tag ||
+		       resp->powr->accumulators[i] != tag * resp->powr->values[i];
+	}
+
+	return bad;
+}
+
+static int occ_test_rcu_bad(struct occ_drv_data *data, int chip)
+{
+	int bad;
+
+	rcu_read_lock();
+	bad = occ_test_resp_bad(rcu_dereference(data->occ_resp), chip);
+	rcu_read_unlock();
+
+	return bad;
+}
+
+struct occ_test_reader {
+	struct occ_drv_data	*data;
+	int			chip;
+	bool			*stop;
+	unsigned long		reads;
+	int			bad;
+	pthread_t		thread;
+};
+
+static void *occ_test_reader_thread(void *arg)
+{
+	struct occ_test_reader *r = arg;
+
+	while (!__atomic_load_n(r->stop, __ATOMIC_ACQUIRE)) {
+		r->bad += occ_test_rcu_bad(r->data, r->chip);
+		/* average = accumulator / update_tag, both from one response */
+		r->bad += occ_test_read(r->data, hwmon_power, hwmon_power_average, 0) !=
+			  (101 + r->chip) * 1000000L;
+		__atomic_add_fetch(&r->reads, 1, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+/* readers running through the buffer swaps never see a half-parsed response */
+static void test_rcu_readers(void)
+{
+	static struct occ_test_reader r[3];
+	struct occ_test_dev t;
+	struct occ_drv_data *data;
+	bool stop = false;
+	int i;
+
+	occ_test_sim_defaults();
+	occ_test_sim_sensors(100, 50, 100);
+	/* the poller sleeps while the OCC answers, and the readers run */
+	occ_test_param("sim_cmd_delay_us", 100);
+	data = occ_test_probe(&t, 0);
+
+	for (i = 0; i < ARRAY_SIZE(r); i++) {
+		memset(&r[i], 0, sizeof(r[i]));
+		r[i].data = data;
+		r[i].stop = &stop;
+		pthread_create(&r[i].thread, NULL, occ_test_reader_thread, &r[i]);
+	}
+	for (i = 0; i < ARRAY_SIZE(r); i++)
+		while (!__atomic_load_n(&r[i].reads, __ATOMIC_RELAXED))
+			sched_yield();
+	/* new readings every time: each poll parses and swaps */
+	for (i = 0; i < 200; i++)
+		occ_test_poll(data);
+	__atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+
+	for (i = 0; i < ARRAY_SIZE(r); i++) {
+		pthread_join(r[i].thread, NULL);
+		CHECK(r[i].reads > 0 && r[i].bad == 0);
+	}
+	CHECK(data->stats.parses == 201 && data->stats.poll_errors == 0);
+	CHECK(occ_test_resp(data)->powr->update_tags[0] == 202);
+	occ_test_remove(&t);
+}
+
+struct occ_test_poller {
+	struct occ_test_dev	t;
+	u64			until;
+	unsigned long		polls;
+	int			bad;
+	pthread_t		thread;
+};
+
+/* poll back to back until the deadline, checking every result */
+static void *occ_test_poller_thread(void *arg)
+{
+	struct occ_test_poller *p = arg;
+	struct occ_drv_data *data = p->t.data;
+	int chip = p->t.adap.nr;
+
+	do {
+		occ_test_poll(data);
+		p->polls++;
+		p->bad += occ_test_rcu_bad(data, chip);
+		p->bad += occ_test_read(data, hwmon_temp, hwmon_temp_input, 0) !=
+			  (31 + chip) * 1000;
+	} while (ktime_get_ns() < p->until);
+
+	return NULL;
+}
+
+/* polls done by n devices polling at once for ns */
+static unsigned long occ_test_poll_parallel(struct occ_test_poller *p, int n, u64 ns)
+{
+	u64 until = ktime_get_ns() + ns;
+	unsigned long polls = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		p[i].until = until;
+		p[i].polls = 0;
+		pthread_create(&p[i].thread, NULL, occ_test_poller_thread, &p[i]);
+	}
+	for (i = 0; i < n; i++) {
+		pthread_join(p[i].thread, NULL);
+		polls = polls + p[i].polls;
+	}
+
+	return polls;
+}
+
+/*
+ * Two OCCs on their own buses, polled at the same time: each only ever
+ * shows its own readings, and two get nearly twice the polls done.
+ */
+static void test_parallel(void)
+{
+	static struct occ_test_poller p[2];
+	unsigned long one, two;
+	int i;
+
+	occ_test_sim_defaults();
+	occ_test_sim_sensors(24, 12, 8);
+	occ_test_param("sim_bus_khz", 400);
+	for (i = 0; i < ARRAY_SIZE(p); i++) {
+		occ_test_probe(&p[i].t, i + 1);
+		p[i].bad = 0;
+		occ_test_poll(p[i].t.data);
+	}
+
+	one = occ_test_poll_parallel(p, 1, 500 * NSEC_PER_MSEC);
+	two = occ_test_poll_parallel(p, 2, 500 * NSEC_PER_MSEC);
+
+	for (i = 0; i < ARRAY_SIZE(p); i++) {
+		CHECK(p[i].bad == 0);
+		CHECK(p[i].t.data->stats.poll_errors == 0);
+		CHECK(occ_test_rcu_bad(p[i].t.data, i + 1) == 0);
+		occ_test_remove(&p[i].t);
+	}
+	/* the bus is the bottleneck, not anything the devices share */
+	CHECK(two * 10 >= one * 17);
+	if (two * 10 < one * 17)
+		fprintf(stderr, "test_parallel: %lu polls alone, %lu with two devices\n",
+			one, two);
+}
+
+/* ----------------------------------------------------------------------*/
+/* OCC_IOC_CMD */
+
+#define OCC_TEST_CMD	0x20	/* not a POLL: the simulator answers INVALID_CMD */
+
+/* a file open on the device, with mode FMODE_READ and/or FMODE_WRITE */
+static void occ_test_open(struct occ_drv_data *data, struct file *filp, unsigned int mode)
+{
+	memset(filp, 0, sizeof(*filp));
+	filp->private_data = &data->miscdev;
+	filp->f_mode = mode;
+	CHECK(!occ_ring_open(NULL, filp));
+}
+
+static int occ_test_queued(struct occ_drv_data *data)
+{
+	struct occ_cmd_req *req;
+	int n = 0;
+
+	spin_lock(&data->cmd_lock);
+	list_for_each_entry(req, &data->cmd_queue, list)
+		n++;
+	spin_unlock(&data->cmd_lock);
+
+	return n;
+}
+
+/* one OCC_IOC_CMD; it blocks until the poller is done with it */
+struct occ_test_cmd {
+	struct file		*filp;
+	struct occ_cmd_ioc	ioc;
+	void			(*fatal_signal)(void);
+	long			ret;
+	pthread_t		thread;
+};
+
+static long occ_test_ioctl(struct occ_test_cmd *c)
+{
+	return occ_ring_ioctl(c->filp, OCC_IOC_CMD, (unsigned long)&c->ioc);
+}
+
+static void *occ_test_cmd_thread(void *arg)
+{
+	struct occ_test_cmd *c = arg;
+
+	kshim_fatal_signal = c->fatal_signal;
+	c->ret = occ_test_ioctl(c);
+
+	return NULL;
+}
+
+static void occ_test_cmd_init(struct occ_test_cmd *c, struct file *filp,
+			      uint8_t type, uint8_t data0)
+{
+	memset(c, 0, sizeof(*c));
+	c->filp = filp;
+	c->ioc.type = type;
+	c->ioc.data_len = 1;
+	c->ioc.data[0] = data0;
+}
+
+/* start c on its own thread, and wait until it is queued behind n others */
+static void occ_test_cmd_start(struct occ_test_cmd *c, struct occ_drv_data *data, int n)
+{
+	pthread_create(&c->thread, NULL, occ_test_cmd_thread, c);
+	while (occ_test_queued(data) < n + 1)
+		sched_yield();
+}
+
+static long occ_test_cmd_join(struct occ_test_cmd *c)
+{
+	pthread_join(c->thread, NULL);
+	return c->ret;
+}
+
+/*
+ * A plain POLL only reads what the poller reads anyway; everything else
+ * needs the file open for writing, or CAP_SYS_ADMIN.
+ */
+static void test_cmd_perm(void)
+{
+	struct occ_test_dev t;
+	struct occ_drv_data *data;
+	struct occ_test_cmd c;
+	struct file ro, rw;
+	unsigned long delay;
+
+	occ_test_sim_defaults();
+	data = occ_test_probe(&t, 0);
+	kshim_work_pending(&data->poll_work, &delay);
+	occ_test_open(data, &ro, FMODE_READ);
+	occ_test_open(data, &rw, FMODE_READ | FMODE_WRITE);
+
+	occ_test_cmd_init(&c, &ro, OCC_TEST_CMD, 0);
+	CHECK(occ_test_ioctl(&c) == -EPERM);
+	/* a POLL for another version of the data is not a plain one */
+	occ_test_cmd_init(&c, &ro, OCC_CMD_POLL, OCC_POLL_VERSION + 1);
+	CHECK(occ_test_ioctl(&c) == -EPERM);
+	CHECK(occ_test_queued(data) == 0 && !kshim_work_pending(&data->poll_work, &delay));
+
+	occ_test_cmd_init(&c, &ro, OCC_CMD_POLL, OCC_POLL_VERSION);
+	occ_test_cmd_start(&c, data, 0);
+	occ_test_poll(data);
+	CHECK(occ_test_cmd_join(&c) == 0);
+	CHECK(c.ioc.resp[2] == OCC_RESP_SUCCESS && c.ioc.resp_len == data->pub_len);
+
+	kshim_capable = true;
+	occ_test_cmd_init(&c, &ro, OCC_TEST_CMD, 0);
+	occ_test_cmd_start(&c, data, 0);
+	/* sent on the next poll, which is now */
+	CHECK(kshim_work_pending(&data->poll_work, &delay) && delay == 0);
+	occ_test_poll(data);
+	CHECK(occ_test_cmd_join(&c) == 0 && c.ioc.resp[2] == OCC_RESP_INVALID_CMD);
+	kshim_capable = false;
+
+	occ_test_cmd_init(&c, &rw, OCC_TEST_CMD, 0);
+	occ_test_cmd_start(&c, data, 0);
+	occ_test_poll(data);
+	CHECK(occ_test_cmd_join(&c) == 0 && c.ioc.resp[2] == OCC_RESP_INVALID_CMD);
+
+	occ_ring_file_release(NULL, &ro);
+	occ_ring_file_release(NULL, &rw);
+	occ_test_remove(&t);
+}
+
+/*
+ * Queued POLLs all get the response of the one poll that takes them, the
+ * other commands are sent after it, and the bus sees one POLL for all.
+ */
+static void test_cmd_queue(void)
+{
+	static struct occ_test_cmd c[4];
+	struct occ_test_dev t;
+	struct occ_drv_data *data;
+	struct file rw;
+	unsigned long polls, reqs, coalesced;
+	uint8_t seq;
+	int i;
+
+	occ_test_sim_defaults();
+	/* new readings on every POLL: the poll publishes what it read */
+	occ_test_sim_sensors(24, 12, 8);
+	data = occ_test_probe(&t, 0);
+	occ_test_open(data, &rw, FMODE_READ | FMODE_WRITE);
+
+	occ_test_cmd_init(&c[0], &rw, OCC_CMD_POLL, OCC_POLL_VERSION);
+	occ_test_cmd_init(&c[1], &rw, OCC_TEST_CMD, 0);
+	occ_test_cmd_init(&c[2], &rw, OCC_CMD_POLL, OCC_POLL_VERSION);
+	occ_test_cmd_init(&c[3], &rw, OCC_TEST_CMD, 1);
+	for (i = 0; i < ARRAY_SIZE(c); i++)
+		occ_test_cmd_start(&c[i], data, i);
+
+	polls = data->stats.polls;
+	reqs = data->stats.cmd_reqs;
+	coalesced = data->stats.cmd_reqs_coalesced;
+	seq = data->cmd_seq;
+	occ_test_poll(data);
+	for (i = 0; i < ARRAY_SIZE(c); i++)
+		CHECK(occ_test_cmd_join(&c[i]) == 0);
+
+	CHECK(data->stats.polls == polls + 1 && data->stats.poll_errors == 0);
+	CHECK(data->stats.cmd_reqs == reqs + 4);
+	CHECK(data->stats.cmd_reqs_coalesced == coalesced + 2);
+	CHECK(occ_test_queued(data) == 0);
+	/* the poll's own POLL, now published, then the others in order */
+	CHECK(c[0].ioc.resp_len == data->pub_len &&
+	      !memcmp(c[0].ioc.resp, data->occ_pub, data->pub_len));
+	CHECK(c[2].ioc.resp_len == data->pub_len &&
+	      !memcmp(c[2].ioc.resp, data->occ_pub, data->pub_len));
+	CHECK(c[0].ioc.resp[0] == (uint8_t)(seq + 1));
+	CHECK(c[1].ioc.resp[0] == (uint8_t)(seq + 2) && c[1].ioc.resp[2] == OCC_RESP_INVALID_CMD);
+	CHECK(c[3].ioc.resp[0] == (uint8_t)(seq + 3) && c[3].ioc.resp[2] == OCC_RESP_INVALID_CMD);
+
+	occ_ring_file_release(NULL, &rw);
+	occ_test_remove(&t);
+}
+
+/* what the poller would take, and when, for the killed callers below */
+static struct occ_drv_data *occ_test_taker;
+static struct list_head occ_test_taken;
+static bool occ_test_took;
+
+static void occ_test_killed(void)
+{
+}
+
+static void occ_test_killed_taken(void)
+{
+	spin_lock(&occ_test_taker->cmd_lock);
+	occ_take_cmds(occ_test_taker, &occ_test_taken, true);
+	spin_unlock(&occ_test_taker->cmd_lock);
+	__atomic_store_n(&occ_test_took, true, __ATOMIC_RELEASE);
+}
+
+/*
+ * A caller killed while its command is still queued takes it back; one
+ * the poller has taken already waits for it to finish, as it writes into
+ * the request.
+ */
+static void test_cmd_killed(void)
+{
+	struct occ_test_dev t;
+	struct occ_drv_data *data;
+	struct occ_cmd_req *req, *n;
+	struct occ_test_cmd c;
+	struct file ro;
+	unsigned long reqs;
+
+	occ_test_sim_defaults();
+	data = occ_test_probe(&t, 0);
+	occ_test_open(data, &ro, FMODE_READ);
+
+	occ_test_cmd_init(&c, &ro, OCC_CMD_POLL, OCC_POLL_VERSION);
+	c.fatal_signal = occ_test_killed;
+	pthread_create(&c.thread, NULL, occ_test_cmd_thread, &c);
+	CHECK(occ_test_cmd_join(&c) == -ERESTARTSYS);
+	CHECK(occ_test_queued(data) == 0);
+	reqs = data->stats.cmd_reqs;
+	occ_test_poll(data);
+	CHECK(data->stats.cmd_reqs == reqs);
+
+	occ_test_taker = data;
+	INIT_LIST_HEAD(&occ_test_taken);
+	occ_test_took = false;
+	occ_test_cmd_init(&c, &ro, OCC_CMD_POLL, OCC_POLL_VERSION);
+	c.fatal_signal = occ_test_killed_taken;
+	pthread_create(&c.thread, NULL, occ_test_cmd_thread, &c);
+	while (!__atomic_load_n(&occ_test_took, __ATOMIC_ACQUIRE))
+		sched_yield();
+	/* as the poller would finish it */
+	list_for_each_entry_safe(req, n, &occ_test_taken, list)
+		occ_complete_cmd(data, req, data->occ_pub, data->pub_len);
+	CHECK(occ_test_cmd_join(&c) == 0);
+	CHECK(c.ioc.resp_len == data->pub_len &&
+	      !memcmp(c.ioc.resp, data->occ_pub, data->pub_len));
+	CHECK(data->stats.cmd_reqs == reqs + 1);
+
+	occ_ring_file_release(NULL, &ro);
+	occ_test_remove(&t);
+}
+
+static void *occ_test_poll_thread(void *arg)
+{
+	occ_test_poll(arg);
+
+	return NULL;
+}
+
+static bool occ_test_polling(struct occ_drv_data *data)
+{
+	bool polling;
+
+	spin_lock(&data->cmd_lock);
+	polling = data->polling;
+	spin_unlock(&data->cmd_lock);
+
+	return polling;
+}
+
+/* when the poller is due next, 0 if it is not queued */
+static unsigned long occ_test_next_poll(struct occ_drv_data *data)
+{
+	unsigned long due;
+
+	spin_lock(&data->cmd_lock);
+	due = data->poll_queued ? data->poll_due : 0;
+	spin_unlock(&data->cmd_lock);
+
+	return due;
+}
+
+/*
+ * However many callers ask for a POLL, and whenever: between polls they
+ * wait for the next one, due sample_time after the last started; during
+ * one they get its response. Either way the bus sees one POLL command
+ * per interval.
+ */
+static void test_cmd_single_flight(void)
+{
+	static struct occ_test_cmd c[4];
+	struct occ_test_dev t;
+	struct occ_drv_data *data;
+	struct file ro;
+	unsigned long polls, reqs;
+	pthread_t poller;
+	uint8_t seq;
+	int round, i;
+
+	occ_test_sim_defaults();
+	occ_test_sim_sensors(24, 12, 8);
+	data = occ_test_probe(&t, 0);
+	occ_test_open(data, &ro, FMODE_READ);
+
+	for (round = 0; round < 3; round++) {
+		/* between polls: nothing sooner than the next one is due */
+		polls = data->stats.polls;
+		reqs = data->stats.cmd_reqs;
+		seq = data->cmd_seq;
+		for (i = 0; i < ARRAY_SIZE(c); i++) {
+			occ_test_cmd_init(&c[i], &ro, OCC_CMD_POLL, OCC_POLL_VERSION);
+			occ_test_cmd_start(&c[i], data, i);
+		}
+		CHECK(occ_test_next_poll(data) == data->poll_started + data->sample_time);
+		occ_test_poll(data);
+		for (i = 0; i < ARRAY_SIZE(c); i++)
+			CHECK(occ_test_cmd_join(&c[i]) == 0 &&
+			      c[i].ioc.resp[0] == (uint8_t)(seq + 1));
+		CHECK(data->stats.polls == polls + 1 && data->cmd_seq == (uint8_t)(seq + 1));
+		CHECK(data->stats.cmd_reqs == reqs + ARRAY_SIZE(c));
+
+		/* during a poll, slow for the OCC to answer: they join it */
+		occ_test_param("sim_cmd_delay_us", 200000);
+		seq = data->cmd_seq;
+		pthread_create(&poller, NULL, occ_test_poll_thread, data);
+		while (!occ_test_polling(data))
+			sched_yield();
+		for (i = 0; i < ARRAY_SIZE(c); i++) {
+			occ_test_cmd_init(&c[i], &ro, OCC_CMD_POLL, OCC_POLL_VERSION);
+			occ_test_cmd_start(&c[i], data, i);
+		}
+		CHECK(occ_test_polling(data));
+		pthread_join(poller, NULL);
+		for (i = 0; i < ARRAY_SIZE(c); i++)
+			CHECK(occ_test_cmd_join(&c[i]) == 0 &&
+			      c[i].ioc.resp[0] == (uint8_t)(seq + 1));
+		CHECK(data->stats.polls == polls + 2 && data->cmd_seq == (uint8_t)(seq + 1));
+		CHECK(data->stats.cmd_reqs == reqs + 2 * ARRAY_SIZE(c));
+		/* and the next is still a whole interval after it started */
+		CHECK(occ_test_next_poll(data) == data->poll_started + data->sample_time);
+		occ_test_param("sim_cmd_delay_us", 0);
+	}
+	CHECK(data->stats.poll_errors == 0 && occ_test_queued(data) == 0);
+
+	occ_ring_file_release(NULL, &ro);
+	occ_test_remove(&t);
+}
+
+static int run_tests(void)
+{
+	test_checksum();
+	test_sample_response();
+	test_generated_response();
+	test_malformed();
+	test_unchanged();
+	test_schedule();
+	test_bus_errors();
+	test_corrupt();
+	test_tag_bus_errors();
+	test_snapshot();
+	test_rcu_readers();
+	test_parallel();
+	test_cmd_perm();
+	test_cmd_queue();
+	test_cmd_killed();
+	test_cmd_single_flight();
+
+	if (failures) {
+		printf("FAIL: %d checks failed\n", failures);
+		return 1;
+	}
+	printf("PASS\n");
+	return 0;
+}
+
+int main(void)
+{
+	return run_tests();
+}
@@ -0,0 +1,127 @@
+/*
+ * Shared by the userspace tests (occ_test.c) and benchmarks (occ_bench.c)
+ * of the OCC driver. Each is one program built against the kernel-API
+ * shim in shim/, with the simulated OCC (occ_sim.c) in place of the bus.
+ * occ.c is included as is, so its static functions are in reach.
+ */
+
+#ifndef __OCC_TEST_H__
+#define __OCC_TEST_H__
+
+#include <stdlib.h>
+
+#include "../occ.c"
+
+/* one simulated OCC on its own bus */
+struct occ_test_dev {
+	struct i2c_adapter	adap;
+	struct i2c_client	client;
+	struct occ_drv_data	*data;
+};
+
+static void occ_test_param(const char *name, long val)
+{
+	char s[24];
+
+	snprintf(s, sizeof(s), "%ld", val);
+	if (kshim_param_set(name, s)) {
+		fprintf(stderr, "no parameter %s\n", name);
+		exit(2);
+	}
+}
+
+/* the simulator as loaded with simulate=1 and nothing else */
+static void occ_test_sim_defaults(void)
+{
+	occ_test_param("simulate", 1);
+	occ_test_param("sim_temp", -1);
+	occ_test_param("sim_freq", -1);
+	occ_test_param("sim_powr", -1);
+	occ_test_param("sim_xfer_delay_us", 0);
+	occ_test_param("sim_bus_khz", 0);
+	occ_test_param("sim_msg_overhead_us", 0);
+	occ_test_param("sim_update_ms", 0);
+	occ_test_param("sim_cmd_delay_us", 0);
+	occ_test_param("sim_fail_every", 0);
+	occ_test_param("sim_corrupt_every", 0);
+	revalidate = false;
+}
+
+static void occ_test_sim_sensors(int temp, int freq, int powr)
+{
+	occ_test_param("sim_temp", temp);
+	occ_test_param("sim_freq", freq);
+	occ_test_param("sim_powr", powr);
+}
+
+static struct occ_drv_data *occ_test_probe(struct occ_test_dev *t, int nr)
+{
+	memset(t, 0, sizeof(*t));
+	t->adap.nr = nr;
+	t->client.adapter = &t->adap;
+	snprintf(t->client.name, sizeof(t->client.name), "occ");
+	snprintf(t->client.dev.name, sizeof(t->client.dev.name), "%d-0050", nr);
+
+	if (occ_probe(&t->client, NULL)) {
+		fprintf(stderr, "probe of %s failed\n", t->client.dev.name);
+		exit(2);
+	}
+	t->data = i2c_get_clientdata(&t->client);
+
+	return t->data;
+}
+
+static void occ_test_remove(struct occ_test_dev *t)
+{
+	occ_remove(&t->client);
+	kshim_devres_release(&t->client.dev);
+}
+
+/* what the work item would do when due */
+static void occ_test_poll(struct occ_drv_data *data)
+{
+	occ_poll_worker(&data->poll_work.work);
+}
+
+/*
+ * whether the poller was queued to run period after the last poll
+ * started; a poll without bus delays takes under a jiffy
+ */
+static bool occ_test_due_in(struct occ_drv_data *data, unsigned long period)
+{
+	unsigned long delay;
+
+	return kshim_work_pending(&data->poll_work, &delay) &&
+	       delay <= period && delay + 1 >= period;
+}
+
+static occ_response_t *occ_test_resp(struct occ_drv_data *data)
+{
+	return rcu_dereference(data->occ_resp);
+}
+
+static int occ_test_channels(struct device *hwmon_dev, enum hwmon_sensor_types type)
+{
+	const struct hwmon_channel_info **info;
+	int n = 0;
+
+	for (info = hwmon_dev->chip->info; *info; info++)
+		if ((*info)->type == type)
+			while ((*info)->config[n])
+				n++;
+
+	return n;
+}
+
+static long occ_test_read(struct occ_drv_data *data, enum hwmon_sensor_types type,
+			  u32 attr, int channel)
+{
+	long val = -1;
+
+	if (data->hwmon_dev->chip->ops->read(data->hwmon_dev, type, attr, channel, &val))
+		return -1;
+
+	return val;
+}
+
+#endif /* __OCC_TEST_H__ */
@@ -0,0 +1,669 @@
+/*
+ * Implementation of the kernel API stand-ins declared in kshim.h.
+ */
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include "kshim.h"
+
+static bool kshim_verbose(void)
+{
+	static int verbose = -1;
+
+	if (verbose < 0)
+		verbose = getenv("OCC_TEST_VERBOSE") != NULL;
+	return verbose;
+}
+
+int printk(const char *fmt, ...)
+{
+	va_list ap;
+
+	if (!kshim_verbose())
+		return 0;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	return 0;
+}
+
+int dev_printk_(const struct device *dev, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (!kshim_verbose())
+		return 0;
+	fprintf(stderr, "%s: ", dev->name);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	return 0;
+}
+
+int scnprintf(char *buf, size_t size, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (!size)
+		return 0;
+	va_start(ap, fmt);
+	n = vsnprintf(buf, size, fmt, ap);
+	va_end(ap);
+	return n >= (int)size ? (int)size - 1 : n;
+}
+
+/* ----------------------------------------------------------------------*/
+/* allocation */
+
+unsigned long kshim_allocs;
+unsigned long kshim_alloc_bytes;
+
+/* cacheline aligned, as kmalloc is for the sizes the driver asks for */
+static void *kshim_alloc(size_t size, bool zero)
+{
+	void *p;
+
+	__atomic_add_fetch(&kshim_allocs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&kshim_alloc_bytes, size, __ATOMIC_RELAXED);
+	if (posix_memalign(&p, 64, size ? size : 1))
+		return NULL;
+	if (zero)
+		memset(p, 0, size);
+	return p;
+}
+
+void *kmalloc(size_t size, gfp_t gfp)
+{
+	return kshim_alloc(size, false);
+}
+
+void *kzalloc(size_t size, gfp_t gfp)
+{
+	return kshim_alloc(size, true);
+}
+
+void *kcalloc(size_t n, size_t size, gfp_t gfp)
+{
+	return kshim_alloc(n * size, true);
+}
+
+void kfree(const void *p)
+{
+	free((void *)p);
+}
+
+void *vmalloc_user(unsigned long size)
+{
+	return kshim_alloc(size, true);
+}
+
+void vfree(const void *p)
+{
+	free((void *)p);
+}
+
+void *kvzalloc(size_t size, gfp_t gfp)
+{
+	return kshim_alloc(size, true);
+}
+
+void kvfree(const void *p)
+{
+	free((void *)p);
+}
+
+/*
+ * devm allocations and actions are chained per device, newest first, for
+ * kshim_devres_release()
+ */
+struct kshim_devres {
+	struct kshim_devres	*next;
+	struct device		*dev;
+	void			(*action)(void *);
+	void			*action_data;
+	max_align_t		data[] ____cacheline_aligned;
+};
+
+static struct kshim_devres *kshim_devres;
+static pthread_mutex_t kshim_devres_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void *devm_kzalloc(struct device *dev, size_t size, gfp_t gfp)
+{
+	struct kshim_devres *dr = kshim_alloc(sizeof(*dr) + size, true);
+
+	if (!dr)
+		return NULL;
+	dr->dev = dev;
+	pthread_mutex_lock(&kshim_devres_lock);
+	dr->next = kshim_devres;
+	kshim_devres = dr;
+	pthread_mutex_unlock(&kshim_devres_lock);
+	return dr->data;
+}
+
+void *devm_kcalloc(struct device *dev, size_t n, size_t size, gfp_t gfp)
+{
+	return devm_kzalloc(dev, n * size, gfp);
+}
+
+int devm_add_action_or_reset(struct device *dev, void (*action)(void *), void *data)
+{
+	void *p = devm_kzalloc(dev, 0, GFP_KERNEL);
+	struct kshim_devres *dr;
+
+	if (!p) {
+		action(data);
+		return -ENOMEM;
+	}
+	dr = container_of(p, struct kshim_devres, data);
+	dr->action = action;
+	dr->action_data = data;
+	return 0;
+}
+
+char *devm_kasprintf(struct device *dev, gfp_t gfp, const char *fmt, ...)
+{
+	va_list ap;
+	char *s;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+
+	s = devm_kzalloc(dev, n + 1, gfp);
+	if (!s)
+		return NULL;
+	va_start(ap, fmt);
+	vsnprintf(s, n + 1, fmt, ap);
+	va_end(ap);
+	return s;
+}
+
+void kshim_devres_release(struct device *dev)
+{
+	struct kshim_devres **p, *dr;
+
+	pthread_mutex_lock(&kshim_devres_lock);
+	for (p = &kshim_devres; (dr = *p);) {
+		if (dr->dev == dev) {
+			*p = dr->next;
+			if (dr->action)
+				dr->action(dr->action_data);
+			free(dr);
+		} else {
+			p = &dr->next;
+		}
+	}
+	pthread_mutex_unlock(&kshim_devres_lock);
+}
+
+/* ----------------------------------------------------------------------*/
+/* time */
+
+u64 ktime_get_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+ktime_t ktime_get(void)
+{
+	return ktime_get_ns();
+}
+
+s64 ktime_us_delta(ktime_t later, ktime_t earlier)
+{
+	return (later - earlier) / NSEC_PER_USEC;
+}
+
+/* starts well away from 0, like the kernel's, to catch wrap bugs early */
+unsigned long kshim_jiffies(void)
+{
+	return (unsigned long)(ktime_get_ns() / NSEC_PER_MSEC) - 300000UL;
+}
+
+unsigned long msecs_to_jiffies(unsigned int m)
+{
+	return m;
+}
+
+unsigned int jiffies_to_msecs(unsigned long j)
+{
+	return j;
+}
+
+void ndelay(unsigned long ns)
+{
+	u64 end = ktime_get_ns() + ns;
+
+	while (ktime_get_ns() < end)
+		;
+}
+
+void udelay(unsigned long us)
+{
+	ndelay(us * NSEC_PER_USEC);
+}
+
+void usleep_range(unsigned long min, unsigned long max)
+{
+	struct timespec ts = {
+		.tv_sec = min / 1000000,
+		.tv_nsec = (min % 1000000) * NSEC_PER_USEC,
+	};
+
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
+
+void msleep(unsigned int ms)
+{
+	usleep_range(ms * 1000UL, ms * 1000UL);
+}
+
+/* ----------------------------------------------------------------------*/
+/* locking */
+
+void mutex_init(struct mutex *lock)
+{
+	pthread_mutex_init(&lock->m, NULL);
+}
+
+void mutex_lock(struct mutex *lock)
+{
+	pthread_mutex_lock(&lock->m);
+}
+
+void mutex_unlock(struct mutex *lock)
+{
+	pthread_mutex_unlock(&lock->m);
+}
+
+void spin_lock_init(spinlock_t *lock)
+{
+	pthread_mutex_init(&lock->m, NULL);
+}
+
+void spin_lock(spinlock_t *lock)
+{
+	pthread_mutex_lock(&lock->m);
+}
+
+void spin_unlock(spinlock_t *lock)
+{
+	pthread_mutex_unlock(&lock->m);
+}
+
+/* writer-preferring, so a steady stream of readers cannot starve a writer */
+static void kshim_rwlock_init(pthread_rwlock_t *l)
+{
+	pthread_rwlockattr_t attr;
+
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(l, &attr);
+	pthread_rwlockattr_destroy(&attr);
+}
+
+void init_rwsem(struct rw_semaphore *sem)
+{
+	kshim_rwlock_init(&sem->l);
+}
+
+void down_read(struct rw_semaphore *sem)
+{
+	pthread_rwlock_rdlock(&sem->l);
+}
+
+void up_read(struct rw_semaphore *sem)
+{
+	pthread_rwlock_unlock(&sem->l);
+}
+
+void down_write(struct rw_semaphore *sem)
+{
+	pthread_rwlock_wrlock(&sem->l);
+}
+
+void up_write(struct rw_semaphore *sem)
+{
+	pthread_rwlock_unlock(&sem->l);
+}
+
+/*
+ * A grace period is over once every reader that was inside a read-side
+ * section has left it: taking the lock for writing waits for exactly that.
+ */
+static pthread_rwlock_t kshim_rcu;
+static pthread_once_t kshim_rcu_once = PTHREAD_ONCE_INIT;
+
+static void kshim_rcu_init(void)
+{
+	kshim_rwlock_init(&kshim_rcu);
+}
+
+void rcu_read_lock(void)
+{
+	pthread_once(&kshim_rcu_once, kshim_rcu_init);
+	pthread_rwlock_rdlock(&kshim_rcu);
+}
+
+void rcu_read_unlock(void)
+{
+	pthread_rwlock_unlock(&kshim_rcu);
+}
+
+void synchronize_rcu(void)
+{
+	pthread_once(&kshim_rcu_once, kshim_rcu_init);
+	pthread_rwlock_wrlock(&kshim_rcu);
+	pthread_rwlock_unlock(&kshim_rcu);
+}
+
+/* ----------------------------------------------------------------------*/
+/* wait queues and completions */
+
+void init_waitqueue_head(wait_queue_head_t *wq)
+{
+	pthread_mutex_init(&wq->m, NULL);
+	pthread_cond_init(&wq->c, NULL);
+}
+
+void wake_up_interruptible_all(wait_queue_head_t *wq)
+{
+	pthread_mutex_lock(&wq->m);
+	pthread_cond_broadcast(&wq->c);
+	pthread_mutex_unlock(&wq->m);
+}
+
+/* the condition is not rechecked under the lock: wake up now and then */
+void kshim_wait(wait_queue_head_t *wq)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += NSEC_PER_MSEC;
+	if (ts.tv_nsec >= NSEC_PER_SEC) {
+		ts.tv_sec++;
+		ts.tv_nsec -= NSEC_PER_SEC;
+	}
+	pthread_mutex_lock(&wq->m);
+	pthread_cond_timedwait(&wq->c, &wq->m, &ts);
+	pthread_mutex_unlock(&wq->m);
+}
+
+void init_completion(struct completion *x)
+{
+	pthread_mutex_init(&x->m, NULL);
+	pthread_cond_init(&x->c, NULL);
+	x->done = 0;
+}
+
+void complete(struct completion *x)
+{
+	pthread_mutex_lock(&x->m);
+	x->done++;
+	pthread_cond_signal(&x->c);
+	pthread_mutex_unlock(&x->m);
+}
+
+void wait_for_completion(struct completion *x)
+{
+	pthread_mutex_lock(&x->m);
+	while (!x->done)
+		pthread_cond_wait(&x->c, &x->m);
+	x->done--;
+	pthread_mutex_unlock(&x->m);
+}
+
+__thread void (*kshim_fatal_signal)(void);
+
+int wait_for_completion_killable(struct completion *x)
+{
+	int ret = 0;
+
+	if (!kshim_fatal_signal) {
+		wait_for_completion(x);
+		return 0;
+	}
+
+	kshim_fatal_signal();
+	pthread_mutex_lock(&x->m);
+	if (x->done)
+		x->done--;
+	else
+		ret = -ERESTARTSYS;
+	pthread_mutex_unlock(&x->m);
+
+	return ret;
+}
+
+unsigned long wait_for_completion_timeout(struct completion *x, unsigned long timeout)
+{
+	u64 end = ktime_get_ns() + (u64)jiffies_to_msecs(timeout) * NSEC_PER_MSEC;
+	unsigned long left = 0;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout / HZ;
+	ts.tv_nsec += (timeout % HZ) * (NSEC_PER_SEC / HZ);
+	if (ts.tv_nsec >= NSEC_PER_SEC) {
+		ts.tv_sec++;
+		ts.tv_nsec -= NSEC_PER_SEC;
+	}
+
+	pthread_mutex_lock(&x->m);
+	while (!x->done && !pthread_cond_timedwait(&x->c, &x->m, &ts))
+		;
+	if (x->done) {
+		x->done--;
+		left = max_t(s64, (s64)(end - ktime_get_ns()) / NSEC_PER_MSEC, 1);
+	}
+	pthread_mutex_unlock(&x->m);
+
+	return left;
+}
+
+/* ----------------------------------------------------------------------*/
+/* work items */
+
+struct workqueue_struct *system_wq;
+static pthread_mutex_t kshim_work_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool mod_delayed_work(struct workqueue_struct *wq, struct delayed_work *dw,
+		      unsigned long delay)
+{
+	bool was;
+
+	pthread_mutex_lock(&kshim_work_lock);
+	was = dw->pending;
+	dw->pending = true;
+	dw->delay = delay;
+	pthread_mutex_unlock(&kshim_work_lock);
+
+	return was;
+}
+
+bool cancel_delayed_work_sync(struct delayed_work *dw)
+{
+	bool was;
+
+	pthread_mutex_lock(&kshim_work_lock);
+	was = dw->pending;
+	dw->pending = false;
+	pthread_mutex_unlock(&kshim_work_lock);
+
+	return was;
+}
+
+/* whether dw was queued since this was last called, and with what delay */
+bool kshim_work_pending(struct delayed_work *dw, unsigned long *delay)
+{
+	bool was;
+
+	pthread_mutex_lock(&kshim_work_lock);
+	was = dw->pending;
+	if (delay)
+		*delay = dw->delay;
+	dw->pending = false;
+	pthread_mutex_unlock(&kshim_work_lock);
+
+	return was;
+}
+
+/* ----------------------------------------------------------------------*/
+/* module parameters */
+
+struct kshim_param {
+	const char	*name;
+	void		*var;
+	int		type;
+};
+
+static struct kshim_param kshim_params[32];
+static int kshim_num_params;
+
+void kshim_param_add(const char *name, void *var, int type)
+{
+	if (kshim_num_params == ARRAY_SIZE(kshim_params))
+		abort();
+	kshim_params[kshim_num_params++] = (struct kshim_param){ name, var, type };
+}
+
+/* what loading the module with name=val does; -ENOENT if there is none */
+int kshim_param_set(const char *name, const char *val)
+{
+	struct kshim_param *p;
+	int i;
+
+	for (i = 0; i < kshim_num_params; i++) {
+		p = &kshim_params[i];
+		if (strcmp(p->name, name))
+			continue;
+		if (p->type == kshim_param_bool)
+			*(bool *)p->var = strtol(val, NULL, 0) != 0;
+		else if (p->type == kshim_param_int)
+			*(int *)p->var = strtol(val, NULL, 0);
+		else
+			*(unsigned int *)p->var = strtoul(val, NULL, 0);
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+/* ----------------------------------------------------------------------*/
+/* i2c, hwmon, misc device */
+
+int i2c_master_send(const struct i2c_client *client, const char *buf, int count)
+{
+	return -EIO;
+}
+
+int i2c_master_recv(const struct i2c_client *client, char *buf, int count)
+{
+	return -EIO;
+}
+
+int i2c_transfer(struct i2c_adapter *adap, struct i2c_msg *msgs, int num)
+{
+	return -EIO;
+}
+
+unsigned long i2c_get_functionality(struct i2c_adapter *adap)
+{
+	return I2C_FUNC_I2C;
+}
+
+struct device *hwmon_device_register_with_info(struct device *dev, const char *name,
+					       void *drvdata,
+					       const struct hwmon_chip_info *chip,
+					       const struct attribute_group **groups)
+{
+	static int hwmon_ids;
+	struct device *hdev = calloc(1, sizeof(*hdev));
+
+	if (!hdev)
+		return ERR_PTR(-ENOMEM);
+	snprintf(hdev->name, sizeof(hdev->name), "hwmon%d",
+		 __atomic_fetch_add(&hwmon_ids, 1, __ATOMIC_RELAXED));
+	hdev->driver_data = drvdata;
+	hdev->chip = chip;
+	hdev->groups = groups;
+
+	return hdev;
+}
+
+void hwmon_device_unregister(struct device *dev)
+{
+	free(dev);
+}
+
+int misc_register(struct miscdevice *misc)
+{
+	return 0;
+}
+
+void misc_deregister(struct miscdevice *misc)
+{
+}
+
+int remap_vmalloc_range(struct vm_area_struct *vma, void *addr, unsigned long pgoff)
+{
+	return 0;
+}
+
+void poll_wait(struct file *filp, wait_queue_head_t *wq, poll_table *p)
+{
+}
+
+loff_t no_llseek(struct file *filp, loff_t off, int whence)
+{
+	return -ESPIPE;
+}
+
+long compat_ptr_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	return -ENOTTY;
+}
+
+int nonseekable_open(struct inode *inode, struct file *filp)
+{
+	return 0;
+}
+
+bool kshim_capable;
+
+bool capable(int cap)
+{
+	return kshim_capable;
+}
+
+unsigned long copy_to_user(void __user *to, const void *from, unsigned long n)
+{
+	memcpy(to, from, n);
+	return 0;
+}
+
+unsigned long copy_from_user(void *to, const void __user *from, unsigned long n)
+{
+	memcpy(to, from, n);
+	return 0;
+}
+
+/* ----------------------------------------------------------------------*/
+/* lib */
+
+void sort(void *base, size_t num, size_t size,
+	  int (*cmp)(const void *a, const void *b),
+	  void (*swap)(void *a, void *b, int size))
+{
+	qsort(base, num, size, cmp);
+}
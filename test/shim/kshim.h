@@ -0,0 +1,522 @@
+/*
+ * Userspace stand-ins for the kernel APIs occ.c and occ_sim.c use, so the
+ * driver builds unchanged as part of a test program. Every <linux/...>
+ * and <asm/...> header the driver includes resolves to this one.
+ *
+ * Locks are pthread locks, RCU is a writer-preferring rwlock, jiffies and
+ * ktime follow CLOCK_MONOTONIC with HZ 1000. Work items are not run: the
+ * tests call the poller themselves, see kshim_work_pending().
+ */
+
+#ifndef __KSHIM_H__
+#define __KSHIM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64;
+typedef long long s64;
+typedef unsigned int gfp_t;
+typedef unsigned short umode_t;
+typedef unsigned int __poll_t;
+
+#define GFP_KERNEL	0
+#define __rcu
+#define __user
+#define __init
+#define __exit
+#define __packed	__attribute__((packed))
+#define __aligned(x)	__attribute__((aligned(x)))
+#define ____cacheline_aligned	__attribute__((aligned(64)))
+
+#define HZ		1000
+#define PAGE_SIZE	4096UL
+#define PAGE_ALIGN(x)	(((x) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+
+#define EPERM		1
+#define EINTR		4
+#define EIO		5
+#define EAGAIN		11
+#define ENOMEM		12
+#define EFAULT		14
+#define EBUSY		16
+#define ENODEV		19
+#define EINVAL		22
+#define ENOTTY		25
+#define ENOSPC		28
+#define ENODATA		61
+#define EPROTO		71
+#define EBADMSG		74
+#define EMSGSIZE	90
+#define EOPNOTSUPP	95
+#define ETIMEDOUT	110
+#define ERESTARTSYS	512
+
+#define S_IRUGO		0444
+#define S_IWUSR		0200
+#define S_IRUSR		0400
+
+#define NSEC_PER_USEC	1000L
+#define NSEC_PER_MSEC	1000000L
+#define NSEC_PER_SEC	1000000000L
+#define USEC_PER_MSEC	1000L
+
+#define ARRAY_SIZE(a)	(sizeof(a) / sizeof((a)[0]))
+#define ALIGN(x, a)	(((x) + (a) - 1) & ~((a) - 1))
+#define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
+#define min(a, b)	((a) < (b) ? (a) : (b))
+#define max(a, b)	((a) > (b) ? (a) : (b))
+#define min_t(t, a, b)	((t)(a) < (t)(b) ? (t)(a) : (t)(b))
+#define max_t(t, a, b)	((t)(a) > (t)(b) ? (t)(a) : (t)(b))
+#define clamp_val(v, lo, hi)	min(max(v, lo), hi)
+#define offsetofend(t, m)	(offsetof(t, m) + sizeof(((t *)0)->m))
+#define container_of(p, t, m)	((t *)((char *)(p) - offsetof(t, m)))
+
+#define READ_ONCE(x)		(*(volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, v)	(*(volatile __typeof__(x) *)&(x) = (v))
+#define smp_store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define smp_load_acquire(p)	__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define smp_wmb()		__atomic_thread_fence(__ATOMIC_RELEASE)
+#define smp_rmb()		__atomic_thread_fence(__ATOMIC_ACQUIRE)
+
+/* printk and dev_*(): quiet unless OCC_TEST_VERBOSE is set */
+int printk(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+#define pr_debug(...)	printk(__VA_ARGS__)
+#define pr_err(...)	printk(__VA_ARGS__)
+#define pr_info(...)	printk(__VA_ARGS__)
+int scnprintf(char *buf, size_t size, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+/* allocation, counted in kshim_allocs and kshim_alloc_bytes */
+struct device;
+extern unsigned long kshim_allocs;
+extern unsigned long kshim_alloc_bytes;
+void *kmalloc(size_t size, gfp_t gfp);
+void *kzalloc(size_t size, gfp_t gfp);
+void *kcalloc(size_t n, size_t size, gfp_t gfp);
+void kfree(const void *p);
+void *vmalloc_user(unsigned long size);
+void vfree(const void *p);
+void *kvzalloc(size_t size, gfp_t gfp);
+void kvfree(const void *p);
+void *devm_kzalloc(struct device *dev, size_t size, gfp_t gfp);
+void *devm_kcalloc(struct device *dev, size_t n, size_t size, gfp_t gfp);
+int devm_add_action_or_reset(struct device *dev, void (*action)(void *), void *data);
+char *devm_kasprintf(struct device *dev, gfp_t gfp, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+/* what the kernel does after remove(): undo dev's devm allocations and actions */
+void kshim_devres_release(struct device *dev);
+
+#define MAX_ERRNO	4095
+#define IS_ERR(p)	((unsigned long)(p) >= (unsigned long)-MAX_ERRNO)
+#define PTR_ERR(p)	((long)(p))
+#define ERR_PTR(e)	((void *)(long)(e))
+
+/* time */
+unsigned long kshim_jiffies(void);
+#define jiffies		kshim_jiffies()
+#define time_after(a, b)	((long)((b) - (a)) < 0)
+#define time_before(a, b)	time_after(b, a)
+#define time_after_eq(a, b)	((long)((a) - (b)) >= 0)
+unsigned long msecs_to_jiffies(unsigned int m);
+unsigned int jiffies_to_msecs(unsigned long j);
+typedef s64 ktime_t;
+u64 ktime_get_ns(void);
+ktime_t ktime_get(void);
+s64 ktime_us_delta(ktime_t later, ktime_t earlier);
+void ndelay(unsigned long ns);
+void udelay(unsigned long us);
+void usleep_range(unsigned long min, unsigned long max);
+void msleep(unsigned int ms);
+static inline u64 div_u64(u64 a, u32 b) { return a / b; }
+static inline u64 div64_u64(u64 a, u64 b) { return a / b; }
+
+/* locking */
+struct mutex { pthread_mutex_t m; };
+void mutex_init(struct mutex *lock);
+void mutex_lock(struct mutex *lock);
+void mutex_unlock(struct mutex *lock);
+
+typedef struct { pthread_mutex_t m; } spinlock_t;
+void spin_lock_init(spinlock_t *lock);
+void spin_lock(spinlock_t *lock);
+void spin_unlock(spinlock_t *lock);
+
+struct rw_semaphore { pthread_rwlock_t l; };
+void init_rwsem(struct rw_semaphore *sem);
+void down_read(struct rw_semaphore *sem);
+void up_read(struct rw_semaphore *sem);
+void down_write(struct rw_semaphore *sem);
+void up_write(struct rw_semaphore *sem);
+
+/* RCU: readers share a lock that synchronize_rcu() takes for writing */
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+void synchronize_rcu(void);
+#define rcu_dereference(p)		__atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define rcu_dereference_protected(p, c)	(p)
+#define rcu_assign_pointer(p, v)	__atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+/* lists */
+struct list_head { struct list_head *next, *prev; };
+#define LIST_HEAD(n)	struct list_head n = { &(n), &(n) }
+
+static inline void INIT_LIST_HEAD(struct list_head *h)
+{
+	h->next = h;
+	h->prev = h;
+}
+
+static inline void list_add_tail(struct list_head *n, struct list_head *h)
+{
+	n->prev = h->prev;
+	n->next = h;
+	h->prev->next = n;
+	h->prev = n;
+}
+
+static inline void list_del(struct list_head *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+}
+
+static inline int list_empty(const struct list_head *h)
+{
+	return h->next == h;
+}
+
+static inline void list_move_tail(struct list_head *e, struct list_head *h)
+{
+	list_del(e);
+	list_add_tail(e, h);
+}
+
+#define list_entry(p, t, m)	container_of(p, t, m)
+#define list_for_each_entry(p, h, m)					\
+	for (p = list_entry((h)->next, __typeof__(*p), m); &p->m != (h);	\
+	     p = list_entry(p->m.next, __typeof__(*p), m))
+#define list_for_each_entry_safe(p, n, h, m)				\
+	for (p = list_entry((h)->next, __typeof__(*p), m),		\
+	     n = list_entry(p->m.next, __typeof__(*p), m); &p->m != (h);	\
+	     p = n, n = list_entry(n->m.next, __typeof__(*p), m))
+
+/* wait queues and completions */
+typedef struct { pthread_mutex_t m; pthread_cond_t c; } wait_queue_head_t;
+void init_waitqueue_head(wait_queue_head_t *wq);
+void wake_up_interruptible_all(wait_queue_head_t *wq);
+void kshim_wait(wait_queue_head_t *wq);
+#define wait_event_interruptible(wq, cond)				\
+	({ while (!(cond)) kshim_wait(&(wq)); 0; })
+
+struct completion {
+	pthread_mutex_t	m;
+	pthread_cond_t	c;
+	unsigned int	done;
+};
+void init_completion(struct completion *x);
+void complete(struct completion *x);
+void wait_for_completion(struct completion *x);
+/*
+ * Nothing is ever killed, unless a thread sets kshim_fatal_signal: its
+ * killable waits call it first, then fail unless the completion is done.
+ */
+extern __thread void (*kshim_fatal_signal)(void);
+int wait_for_completion_killable(struct completion *x);
+unsigned long wait_for_completion_timeout(struct completion *x, unsigned long timeout);
+
+/* work items: recorded, never run, see kshim_work_pending() */
+struct work_struct { void (*func)(struct work_struct *work); };
+struct delayed_work {
+	struct work_struct	work;
+	bool			pending;
+	unsigned long		delay;	/* of the last (re)queueing */
+};
+struct workqueue_struct;
+extern struct workqueue_struct *system_wq;
+#define INIT_DELAYED_WORK(w, f)	((w)->work.func = (f), (w)->pending = false)
+bool mod_delayed_work(struct workqueue_struct *wq, struct delayed_work *dw,
+		      unsigned long delay);
+bool cancel_delayed_work_sync(struct delayed_work *dw);
+static inline struct delayed_work *to_delayed_work(struct work_struct *work)
+{
+	return container_of(work, struct delayed_work, work);
+}
+bool kshim_work_pending(struct delayed_work *dw, unsigned long *delay);
+
+/* devices and sysfs */
+struct kobject { int unused; };
+struct device {
+	struct kobject	kobj;
+	void		*driver_data;
+	char		name[32];
+	/* hwmon devices: what they were registered with */
+	const struct hwmon_chip_info	*chip;
+	const struct attribute_group	**groups;
+};
+
+static inline void *dev_get_drvdata(const struct device *dev)
+{
+	return dev->driver_data;
+}
+
+static inline const char *dev_name(const struct device *dev)
+{
+	return dev->name;
+}
+
+static inline struct device *kobj_to_dev(struct kobject *kobj)
+{
+	return container_of(kobj, struct device, kobj);
+}
+
+int dev_printk_(const struct device *dev, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+#define dev_info(dev, ...)		dev_printk_(dev, __VA_ARGS__)
+#define dev_dbg(dev, ...)		dev_printk_(dev, __VA_ARGS__)
+#define dev_err(dev, ...)		dev_printk_(dev, __VA_ARGS__)
+#define dev_warn(dev, ...)		dev_printk_(dev, __VA_ARGS__)
+#define dev_err_ratelimited(dev, ...)	dev_printk_(dev, __VA_ARGS__)
+#define dev_warn_ratelimited(dev, ...)	dev_printk_(dev, __VA_ARGS__)
+
+struct attribute { const char *name; umode_t mode; };
+struct device_attribute {
+	struct attribute attr;
+	ssize_t (*show)(struct device *dev, struct device_attribute *attr, char *buf);
+	ssize_t (*store)(struct device *dev, struct device_attribute *attr,
+			 const char *buf, size_t count);
+};
+struct file;
+struct bin_attribute {
+	struct attribute attr;
+	size_t size;
+	ssize_t (*read)(struct file *filp, struct kobject *kobj, struct bin_attribute *attr,
+			char *buf, loff_t off, size_t count);
+};
+struct attribute_group {
+	const char *name;
+	struct attribute **attrs;
+	struct bin_attribute **bin_attrs;
+};
+#define __ATTR(n, m, s, st)	{ .attr = { .name = #n, .mode = m }, .show = s, .store = st }
+#define sysfs_attr_init(attr)	do { } while (0)
+
+struct sensor_device_attribute { struct device_attribute dev_attr; int index; };
+#define to_sensor_dev_attr(a)	container_of(a, struct sensor_device_attribute, dev_attr)
+#define SENSOR_ATTR(n, m, s, st, i)	{ .dev_attr = __ATTR(n, m, s, st), .index = i }
+#define SENSOR_DEVICE_ATTR(n, m, s, st, i) \
+	struct sensor_device_attribute sensor_dev_attr_##n = SENSOR_ATTR(n, m, s, st, i)
+
+/* module: parameters can be set by name, see kshim_param_set() */
+#define THIS_MODULE		NULL
+#define MODULE_AUTHOR(x)
+#define MODULE_DESCRIPTION(x)
+#define MODULE_LICENSE(x)
+#define MODULE_DEVICE_TABLE(type, name)
+#define MODULE_PARM_DESC(name, desc)
+enum { kshim_param_bool, kshim_param_int, kshim_param_uint };
+void kshim_param_add(const char *name, void *var, int type);
+int kshim_param_set(const char *name, const char *val);
+#define module_param(name, type, perm)					\
+	static void __attribute__((constructor)) __kshim_param_##name(void)	\
+	{ kshim_param_add(#name, &name, kshim_param_##type); }
+
+/* i2c: adapters fail every transfer, the simulated OCC stands in */
+struct i2c_adapter { int nr; };
+struct i2c_client {
+	unsigned short		addr;
+	char			name[20];
+	struct i2c_adapter	*adapter;
+	struct device		dev;
+};
+#define to_i2c_client(d)	container_of(d, struct i2c_client, dev)
+struct i2c_device_id { char name[20]; unsigned long driver_data; };
+struct i2c_msg { u16 addr; u16 flags; u16 len; u8 *buf; };
+#define I2C_M_RD		0x0001
+#define I2C_FUNC_I2C		0x00000001
+#define I2C_CLASS_HWMON		(1 << 0)
+int i2c_master_send(const struct i2c_client *client, const char *buf, int count);
+int i2c_master_recv(const struct i2c_client *client, char *buf, int count);
+int i2c_transfer(struct i2c_adapter *adap, struct i2c_msg *msgs, int num);
+unsigned long i2c_get_functionality(struct i2c_adapter *adap);
+
+static inline void i2c_set_clientdata(struct i2c_client *client, void *data)
+{
+	client->dev.driver_data = data;
+}
+
+static inline void *i2c_get_clientdata(const struct i2c_client *client)
+{
+	return client->dev.driver_data;
+}
+
+struct dev_pm_ops { int (*suspend)(struct device *dev); int (*resume)(struct device *dev); };
+#define SIMPLE_DEV_PM_OPS(name, s, r) \
+	const struct dev_pm_ops name = { .suspend = s, .resume = r }
+struct device_driver { const char *name; const struct dev_pm_ops *pm; };
+struct i2c_driver {
+	int class;
+	struct device_driver driver;
+	int (*probe)(struct i2c_client *client, const struct i2c_device_id *id);
+	int (*remove)(struct i2c_client *client);
+	const struct i2c_device_id *id_table;
+	const unsigned short *address_list;
+};
+#define module_i2c_driver(d) \
+	static struct i2c_driver *__kshim_driver __attribute__((unused)) = &(d)
+
+/* hwmon: the returned device carries drvdata, chip and groups */
+enum hwmon_sensor_types { hwmon_chip, hwmon_temp, hwmon_power };
+enum { hwmon_chip_update_interval };
+enum { hwmon_temp_input, hwmon_temp_label };
+enum { hwmon_power_average, hwmon_power_input, hwmon_power_label };
+#define HWMON_C_UPDATE_INTERVAL	(1 << hwmon_chip_update_interval)
+#define HWMON_T_INPUT		(1 << hwmon_temp_input)
+#define HWMON_T_LABEL		(1 << hwmon_temp_label)
+#define HWMON_P_AVERAGE		(1 << hwmon_power_average)
+#define HWMON_P_INPUT		(1 << hwmon_power_input)
+#define HWMON_P_LABEL		(1 << hwmon_power_label)
+struct hwmon_channel_info { enum hwmon_sensor_types type; const u32 *config; };
+struct hwmon_ops {
+	umode_t (*is_visible)(const void *drvdata, enum hwmon_sensor_types type,
+			      u32 attr, int channel);
+	int (*read)(struct device *dev, enum hwmon_sensor_types type,
+		    u32 attr, int channel, long *val);
+	int (*read_string)(struct device *dev, enum hwmon_sensor_types type,
+			   u32 attr, int channel, const char **str);
+	int (*write)(struct device *dev, enum hwmon_sensor_types type,
+		     u32 attr, int channel, long val);
+};
+struct hwmon_chip_info {
+	const struct hwmon_ops *ops;
+	const struct hwmon_channel_info **info;
+};
+struct device *hwmon_device_register_with_info(struct device *dev, const char *name,
+					       void *drvdata,
+					       const struct hwmon_chip_info *chip,
+					       const struct attribute_group **groups);
+void hwmon_device_unregister(struct device *dev);
+
+/* misc device and file operations: registered, never opened */
+struct inode;
+struct vm_area_struct {
+	unsigned long vm_start, vm_end, vm_flags, vm_pgoff;
+	const struct vm_operations_struct *vm_ops;
+	void *vm_private_data;
+};
+struct vm_operations_struct {
+	void (*open)(struct vm_area_struct *vma);
+	void (*close)(struct vm_area_struct *vma);
+};
+#define VM_WRITE	0x00000002
+#define VM_MAYWRITE	0x00000020
+struct poll_table_struct;
+typedef struct poll_table_struct poll_table;
+#define EPOLLIN		0x0001
+#define EPOLLRDNORM	0x0040
+#define EPOLLHUP	0x0010
+#define POLLIN		EPOLLIN
+#define POLLRDNORM	EPOLLRDNORM
+#define POLLHUP		EPOLLHUP
+struct file { void *private_data; unsigned int f_flags; unsigned int f_mode; };
+#define FMODE_READ	0x1
+#define FMODE_WRITE	0x2
+#define O_NONBLOCK	04000
+struct file_operations {
+	void *owner;
+	int (*open)(struct inode *inode, struct file *filp);
+	int (*release)(struct inode *inode, struct file *filp);
+	int (*mmap)(struct file *filp, struct vm_area_struct *vma);
+	__poll_t (*poll)(struct file *filp, poll_table *wait);
+	ssize_t (*read)(struct file *filp, char __user *buf, size_t count, loff_t *ppos);
+	long (*unlocked_ioctl)(struct file *filp, unsigned int cmd, unsigned long arg);
+	long (*compat_ioctl)(struct file *filp, unsigned int cmd, unsigned long arg);
+	loff_t (*llseek)(struct file *filp, loff_t off, int whence);
+};
+struct miscdevice {
+	int minor;
+	const char *name;
+	const struct file_operations *fops;
+	struct device *parent;
+};
+#define MISC_DYNAMIC_MINOR	255
+int misc_register(struct miscdevice *misc);
+void misc_deregister(struct miscdevice *misc);
+int remap_vmalloc_range(struct vm_area_struct *vma, void *addr, unsigned long pgoff);
+void poll_wait(struct file *filp, wait_queue_head_t *wq, poll_table *p);
+loff_t no_llseek(struct file *filp, loff_t off, int whence);
+long compat_ptr_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+int nonseekable_open(struct inode *inode, struct file *filp);
+#define _IOC(dir, type, nr, size)	(((dir) << 30) | ((size) << 16) | ((type) << 8) | (nr))
+#define _IOWR(type, nr, t)		_IOC(3U, (type), (nr), sizeof(t))
+#define _IOC_SIZE(cmd)			(((cmd) >> 16) & 0x3fff)
+unsigned long copy_to_user(void __user *to, const void *from, unsigned long n);
+unsigned long copy_from_user(void *to, const void __user *from, unsigned long n);
+
+/* capabilities: every one if kshim_capable is set, none by default */
+#define CAP_SYS_ADMIN	21
+extern bool kshim_capable;
+bool capable(int cap);
+
+/* kref */
+struct kref { int refcount; };
+static inline void kref_init(struct kref *k) { __atomic_store_n(&k->refcount, 1, __ATOMIC_RELAXED); }
+static inline void kref_get(struct kref *k) { __atomic_add_fetch(&k->refcount, 1, __ATOMIC_RELAXED); }
+static inline int kref_put(struct kref *k, void (*release)(struct kref *k))
+{
+	if (__atomic_sub_fetch(&k->refcount, 1, __ATOMIC_ACQ_REL))
+		return 0;
+	release(k);
+	return 1;
+}
+
+/* byte order, unaligned access */
+static inline u16 get_unaligned_be16(const void *p)
+{
+	const u8 *b = p;
+
+	return b[0] << 8 | b[1];
+}
+
+static inline u32 get_unaligned_be32(const void *p)
+{
+	const u8 *b = p;
+
+	return (u32)b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+}
+
+static inline void put_unaligned_be16(u16 v, void *p)
+{
+	u8 *b = p;
+
+	b[0] = v >> 8;
+	b[1] = v;
+}
+
+static inline void put_unaligned_be32(u32 v, void *p)
+{
+	u8 *b = p;
+
+	b[0] = v >> 24;
+	b[1] = v >> 16;
+	b[2] = v >> 8;
+	b[3] = v;
+}
+
+#define get_unaligned(p)						\
+	({ __typeof__(+*(p)) __v; memcpy(&__v, (p), sizeof(__v)); __v; })
+
+void sort(void *base, size_t num, size_t size,
+	  int (*cmp)(const void *a, const void *b),
+	  void (*swap)(void *a, void *b, int size));
+
+#endif /* __KSHIM_H__ */